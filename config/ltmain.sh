@@ -1 +0,0 @@
-/n/sw/fasrcsw/apps/Core/libtool/2.4.6-fasrc01/share/libtool/build-aux/ltmain.sh
\ No newline at end of file
@@ -1 +0,0 @@
-/n/sw/fasrcsw/apps/Core/libtool/2.4.6-fasrc01/share/aclocal/libtool.m4
\ No newline at end of file
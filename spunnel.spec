@@ -7,7 +7,9 @@ Group: System Environment/Base
 Source0: %{name}-%{version}.tar.gz
 BuildRoot: %{_tmppath}/%{name}-%{version}-%{release}-root
 
-#BuildRequires: slurm-devel
+# spunnel-reap and spunneld link libslurm
+BuildRequires: slurm-devel
+BuildRequires: systemd-rpm-macros
 #Requires: slurm
 
 %description
@@ -29,7 +31,27 @@ rm -rf $RPM_BUILD_ROOT
 make install DESTDIR=$RPM_BUILD_ROOT
 rm  -f $RPM_BUILD_ROOT/%{_libdir}/libspunnel.a
 rm  -f $RPM_BUILD_ROOT/%{_libdir}/libspunnel.la
+install -D -m 0644 spunnel.tmpfiles $RPM_BUILD_ROOT/%{_tmpfilesdir}/spunnel.conf
+install -D -m 0644 spunneld.service $RPM_BUILD_ROOT/%{_unitdir}/spunneld.service
 
+%pre
+# who may write the port registry, see spunnel.tmpfiles
+getent group spunnel >/dev/null || groupadd -r spunnel
+# spunneld runs as a user of its own
+getent group spunneld >/dev/null || groupadd -r spunneld
+getent passwd spunneld >/dev/null || \
+    useradd -r -g spunneld -d / -s /sbin/nologin -c "spunnel relay daemon" spunneld
+exit 0
+
+%post
+systemd-tmpfiles --create %{_tmpfilesdir}/spunnel.conf >/dev/null 2>&1 || :
+%systemd_post spunneld.service
+
+%preun
+%systemd_preun spunneld.service
+
+%postun
+%systemd_postun_with_restart spunneld.service
 
 %clean
 rm -rf $RPM_BUILD_ROOT
@@ -39,6 +61,10 @@ rm -rf $RPM_BUILD_ROOT
 %{_libdir}/libspunnel.so
 %{_libdir}/libspunnel.so.0
 %{_libdir}/libspunnel.so.0.0.7
+%{_sbindir}/spunnel-reap
+%{_sbindir}/spunneld
+%{_tmpfilesdir}/spunnel.conf
+%{_unitdir}/spunneld.service
 %{_datadir}/doc/spunnel/AUTHORS
 %{_datadir}/doc/spunnel/COPYING
 %{_datadir}/doc/spunnel/README.md
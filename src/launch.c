@@ -0,0 +1,259 @@
+/***************************************************************************\
+ launch.c - shell-less child process launching for spunnel
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spunnel.h"
+#include "launch.h"
+
+extern char **environ;
+
+/*
+ * How much of a child's stderr is kept for the plugin log
+ */
+#define SPAWN_ERRBUF_SIZE 4096
+
+int spunnel_argv_push(struct spunnel_argv *av, const char *word)
+{
+    char **v;
+
+    // keep room for the word and the terminating NULL
+    if (av->n + 2 > av->cap) {
+        int cap = av->cap ? av->cap * 2 : 16;
+        v = realloc(av->v, cap * sizeof(char*));
+        if (v == NULL)
+            return -1;
+        av->v = v;
+        av->cap = cap;
+    }
+    if ((av->v[av->n] = strdup(word)) == NULL)
+        return -1;
+    av->n++;
+    av->v[av->n] = NULL;
+    return 0;
+}
+
+/*
+ * Splits str on whitespace and pushes each word.  This is how the
+ * ssh_cmd= and args= plugstack strings become argv entries.
+ */
+int spunnel_argv_push_words(struct spunnel_argv *av, const char *str)
+{
+    char *copy, *word, *ptr;
+    int rc = 0;
+
+    if (str == NULL)
+        return 0;
+    if ((copy = strdup(str)) == NULL)
+        return -1;
+    for (word = strtok_r(copy," \t\n",&ptr); word != NULL && rc == 0;
+         word = strtok_r(NULL," \t\n",&ptr))
+        rc = spunnel_argv_push(av,word);
+    free(copy);
+    return rc;
+}
+
+void spunnel_argv_free(struct spunnel_argv *av)
+{
+    int i;
+    for (i = 0; i < av->n; i++)
+        free(av->v[i]);
+    free(av->v);
+    av->v = NULL;
+    av->n = av->cap = 0;
+}
+
+/*
+ * Starts argv[0] (searched in PATH) directly with posix_spawn, so there is
+ * neither a copy of the srun address space nor a /bin/sh in between.  stdin
+ * and stdout go to /dev/null, stderr to a pipe that spunnel_child_wait
+ * drains into the plugin log.
+ *
+ * Returns 0 and fills child on success, -1 otherwise.
+ */
+int spunnel_spawn(struct spunnel_child *child, char *const argv[])
+{
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    int errpipe[2];
+    int rc;
+
+    child->pid = -1;
+    child->errfd = -1;
+    snprintf(child->name,sizeof(child->name),"%s",argv[0]);
+
+    if (pipe2(errpipe,O_CLOEXEC) < 0) {
+        ERROR("spunnel: unable to create stderr pipe for %s: %s",
+              argv[0],strerror(errno));
+        return -1;
+    }
+
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa,STDIN_FILENO,"/dev/null",O_RDONLY,0);
+    posix_spawn_file_actions_addopen(&fa,STDOUT_FILENO,"/dev/null",O_WRONLY,0);
+    posix_spawn_file_actions_adddup2(&fa,errpipe[1],STDERR_FILENO);
+
+    // don't hand srun's signal mask and handlers down to ssh
+    posix_spawnattr_init(&attr);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr,&mask);
+    sigemptyset(&mask);
+    sigaddset(&mask,SIGPIPE);
+    sigaddset(&mask,SIGINT);
+    sigaddset(&mask,SIGTERM);
+    sigaddset(&mask,SIGHUP);
+    posix_spawnattr_setsigdefault(&attr,&mask);
+    posix_spawnattr_setflags(&attr,POSIX_SPAWN_SETSIGMASK|POSIX_SPAWN_SETSIGDEF);
+
+    rc = posix_spawnp(&child->pid,argv[0],&fa,&attr,argv,environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    close(errpipe[1]);
+
+    if (rc != 0) {
+        ERROR("spunnel: unable to spawn %s: %s",argv[0],strerror(rc));
+        close(errpipe[0]);
+        child->pid = -1;
+        return -1;
+    }
+    child->errfd = errpipe[0];
+    return 0;
+}
+
+/*
+ * Logs what the child wrote on stderr, one plugin log line per line of
+ * output.  Output of a failed child is logged as an error.
+ */
+static void _log_stderr(struct spunnel_child *child, char *buf, int failed)
+{
+    char *line, *ptr;
+
+    for (line = strtok_r(buf,"\r\n",&ptr); line != NULL;
+         line = strtok_r(NULL,"\r\n",&ptr)) {
+        if (failed)
+            ERROR("spunnel: %s: %s",child->name,line);
+        else
+            DEBUG("spunnel: %s: %s",child->name,line);
+    }
+}
+
+/*
+ * Waits for a child started with spunnel_spawn while collecting its stderr.
+ *
+ * ssh -f leaves a daemonized copy of itself holding the write end of the
+ * stderr pipe, so EOF on the pipe cannot be used to detect the end of the
+ * child; the pipe is polled until the pid itself has exited.
+ *
+ * Returns the exit status of the child, 128 + signal number if it was
+ * killed, or -1 if it could not be waited for.
+ */
+int spunnel_child_wait(struct spunnel_child *child)
+{
+    char buf[SPAWN_ERRBUF_SIZE];
+    size_t len = 0;
+    struct pollfd pfd;
+    int wstatus;
+    int status = -1;
+    pid_t rc;
+    ssize_t n;
+
+    if (child->pid <= 0)
+        return -1;
+
+    pfd.fd = child->errfd;
+    pfd.events = POLLIN;
+    for (;;) {
+        // once the pipe is done with there is nothing left to poll for
+        rc = waitpid(child->pid,&wstatus,pfd.fd < 0 ? 0 : WNOHANG);
+        if (rc < 0 && errno != EINTR) {
+            ERROR("spunnel: unable to wait for %s: %s",child->name,strerror(errno));
+            break;
+        }
+        if (rc == child->pid) {
+            if (WIFEXITED(wstatus))
+                status = WEXITSTATUS(wstatus);
+            else if (WIFSIGNALED(wstatus))
+                status = 128 + WTERMSIG(wstatus);
+            break;
+        }
+        if (rc < 0 || poll(&pfd,1,50) <= 0)
+            continue;
+        n = read(pfd.fd,buf + len,sizeof(buf) - 1 - len);
+        if (n > 0)
+            len += n;
+        if (n == 0 || len == sizeof(buf) - 1)
+            pfd.fd = -1;
+    }
+
+    // pick up whatever was written right before the exit
+    if (pfd.fd >= 0) {
+        fcntl(pfd.fd,F_SETFL,O_NONBLOCK);
+        while (len < sizeof(buf) - 1 &&
+               (n = read(pfd.fd,buf + len,sizeof(buf) - 1 - len)) > 0)
+            len += n;
+    }
+    buf[len] = '\0';
+    _log_stderr(child,buf,status != 0);
+
+    close(child->errfd);
+    child->errfd = -1;
+    child->pid = -1;
+    return status;
+}
+
+int spunnel_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open,pid,0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+void spunnel_parent_death(int sig, pid_t parent)
+{
+    prctl(PR_SET_PDEATHSIG,sig);
+    // it may have died before the prctl
+    if (getppid() != parent)
+        raise(sig);
+}
@@ -0,0 +1,68 @@
+/***************************************************************************\
+ launch.h - shell-less child process launching for spunnel
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_LAUNCH_H
+#define _SPUNNEL_LAUNCH_H
+
+#include <sys/types.h>
+
+/*
+ * A NULL terminated argument vector that grows as words are pushed on it
+ */
+struct spunnel_argv {
+    char **v;
+    int    n;
+    int    cap;
+};
+
+int  spunnel_argv_push(struct spunnel_argv *av, const char *word);
+int  spunnel_argv_push_words(struct spunnel_argv *av, const char *str);
+void spunnel_argv_free(struct spunnel_argv *av);
+
+/*
+ * A child started by spunnel_spawn.  errfd is the read end of the pipe
+ * connected to the child's stderr, or -1 once it has been drained.
+ */
+struct spunnel_child {
+    pid_t pid;
+    int   errfd;
+    char  name[64];
+};
+
+int spunnel_spawn(struct spunnel_child *child, char *const argv[]);
+int spunnel_child_wait(struct spunnel_child *child);
+
+/*
+ * A pidfd for process pid, which polls readable once the whole process has
+ * exited.  Returns -1 if the kernel has none (before 5.3).
+ */
+int spunnel_pidfd(pid_t pid);
+
+/*
+ * For a child just forked by parent: it gets sig when the thread that
+ * forked it exits, or right away if parent is already gone
+ */
+void spunnel_parent_death(int sig, pid_t parent);
+
+#endif
@@ -0,0 +1,337 @@
+/***************************************************************************\
+ mux.c - client side of the OpenSSH ControlMaster protocol
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spunnel.h"
+#include "mux.h"
+
+/*
+ * See PROTOCOL.mux in the OpenSSH sources.  Every message is a 32 bit
+ * length followed by that many bytes, which start with the message type.
+ */
+#define MUX_MSG_HELLO          0x00000001
+#define MUX_C_ALIVE_CHECK      0x10000004
+#define MUX_C_TERMINATE        0x10000005
+#define MUX_C_OPEN_FWD         0x10000006
+#define MUX_C_CLOSE_FWD        0x10000007
+#define MUX_S_OK               0x80000001
+#define MUX_S_PERMISSION_DENIED 0x80000002
+#define MUX_S_FAILURE          0x80000003
+#define MUX_S_ALIVE            0x80000005
+#define MUX_FWD_LOCAL          1
+#define MUX_VERSION            4
+
+/*
+ * A message being built, length prefix included
+ */
+struct mux_msg {
+    unsigned char buf[1024];
+    size_t        len;
+};
+
+/*
+ * How long to wait for a master that accepted the connection to answer.
+ * It bounds the connect and hello together, and each request with its
+ * reply, however slowly the other end trickles the bytes in.  The timeout
+ * of a connection is kept in its SO_RCVTIMEO.
+ */
+#define MUX_TIMEOUT_SEC 5
+
+/*
+ * Replies are short; anything longer than the buffer they are read into is
+ * not from a master we want to talk to
+ */
+#define MUX_REPLY_MAX 1024
+
+static void _mux_deadline (int fd, struct timespec *deadline)
+{
+    struct timeval tv = { MUX_TIMEOUT_SEC, 0 };
+    socklen_t len = sizeof(tv);
+
+    getsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,&len);
+    clock_gettime(CLOCK_MONOTONIC,deadline);
+    deadline->tv_sec += tv.tv_sec;
+    deadline->tv_nsec += tv.tv_usec * 1000;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * Waits for events on fd until deadline.  Returns 0 when they are there.
+ */
+static int _mux_wait (int fd, short events, const struct timespec *deadline)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    struct timespec now;
+    long ms;
+    int rc;
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        ms = (deadline->tv_sec - now.tv_sec) * 1000L +
+             (deadline->tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        rc = poll(&pfd,1,ms);
+    } while (rc < 0 && errno == EINTR);
+    return (rc > 0) ? 0 : -1;
+}
+
+static int _mux_write (int fd, const void *buf, size_t len, const struct timespec *deadline)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if (_mux_wait(fd,POLLOUT,deadline) != 0)
+            return -1;
+        n = send(fd,p,len,MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int _mux_read (int fd, void *buf, size_t len, const struct timespec *deadline)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len > 0) {
+        if (_mux_wait(fd,POLLIN,deadline) != 0)
+            return -1;
+        n = recv(fd,p,len,MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Reads one message into buf.  Returns its length or -1, also for a
+ * message that does not fit, which leaves the connection unusable.
+ */
+static int _mux_recv (int fd, unsigned char *buf, size_t size, const struct timespec *deadline)
+{
+    uint32_t len;
+
+    if (_mux_read(fd,&len,4,deadline) != 0)
+        return -1;
+    len = ntohl(len);
+    if (len > size)
+        return -1;
+    return (_mux_read(fd,buf,len,deadline) == 0) ? (int)len : -1;
+}
+
+static uint32_t _mux_get32 (const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v,p,4);
+    return ntohl(v);
+}
+
+static void _mux_put32 (struct mux_msg *m, uint32_t v)
+{
+    v = htonl(v);
+    if (m->len + 4 <= sizeof(m->buf))
+        memcpy(m->buf + m->len,&v,4);
+    m->len += 4;
+}
+
+static void _mux_putstr (struct mux_msg *m, const char *str)
+{
+    size_t n = strlen(str);
+
+    _mux_put32(m,n);
+    if (m->len + n <= sizeof(m->buf))
+        memcpy(m->buf + m->len,str,n);
+    m->len += n;
+}
+
+static void _mux_start (struct mux_msg *m, uint32_t type)
+{
+    static uint32_t rid = 0;
+
+    m->len = 4;
+    _mux_put32(m,type);
+    _mux_put32(m,++rid);
+}
+
+/*
+ * Sends m and reads the reply into reply.  Returns the reply's type, after
+ * checking that it answers m, or 0 on error.  Denials and failures are
+ * logged with the reason the master gave.
+ */
+static uint32_t _mux_request (int fd, struct mux_msg *m, unsigned char *reply, size_t size)
+{
+    struct timespec deadline;
+    uint32_t type, n;
+    int len;
+
+    if (m->len > sizeof(m->buf))
+        return 0;
+    n = htonl(m->len - 4);
+    memcpy(m->buf,&n,4);
+    _mux_deadline(fd,&deadline);
+    if (_mux_write(fd,m->buf,m->len,&deadline) != 0)
+        return 0;
+    if ((len = _mux_recv(fd,reply,size,&deadline)) < 8)
+        return 0;
+    type = _mux_get32(reply);
+    if (memcmp(reply + 4,m->buf + 8,4) != 0) {
+        ERROR("spunnel: ssh control master answered another request");
+        return 0;
+    }
+    if (type == MUX_S_PERMISSION_DENIED || type == MUX_S_FAILURE) {
+        n = (len >= 12) ? _mux_get32(reply + 8) : 0;
+        if (n > len - 12)
+            n = 0;
+        ERROR("spunnel: ssh control master: %.*s",(int)n,(char *)reply + 12);
+    }
+    return type;
+}
+
+int mux_connect (const char *path)
+{
+    return mux_connect_timeout(path,MUX_TIMEOUT_SEC * 1000);
+}
+
+int mux_connect_timeout (const char *path, int msec)
+{
+    struct sockaddr_un addr;
+    struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+    struct timespec deadline;
+    unsigned char buf[MUX_REPLY_MAX];
+    uint32_t hello[3];
+    int fd, len;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path,path);
+
+    if ((fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) < 0)
+        return -1;
+    // the send timeout bounds a connect to a full listen backlog
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+    _mux_deadline(fd,&deadline);
+    if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) != 0)
+        goto fail;
+
+    // the master says hello first
+    len = _mux_recv(fd,buf,sizeof(buf),&deadline);
+    if (len < 8 || _mux_get32(buf) != MUX_MSG_HELLO) {
+        ERROR("spunnel: %s is not an ssh control master",path);
+        goto fail;
+    }
+    if (_mux_get32(buf + 4) != MUX_VERSION) {
+        ERROR("spunnel: ssh control master %s speaks protocol %u",path,_mux_get32(buf + 4));
+        goto fail;
+    }
+
+    hello[0] = htonl(8);
+    hello[1] = htonl(MUX_MSG_HELLO);
+    hello[2] = htonl(MUX_VERSION);
+    if (_mux_write(fd,hello,sizeof(hello),&deadline) != 0)
+        goto fail;
+    return fd;
+
+    fail:
+    close(fd);
+    return -1;
+}
+
+int mux_check (int fd, pid_t *pid)
+{
+    struct mux_msg m;
+    unsigned char reply[MUX_REPLY_MAX];
+
+    _mux_start(&m,MUX_C_ALIVE_CHECK);
+    if (_mux_request(fd,&m,reply,sizeof(reply)) != MUX_S_ALIVE)
+        return -1;
+    if (pid != NULL)
+        *pid = _mux_get32(reply + 8);
+    return 0;
+}
+
+int mux_exit (int fd)
+{
+    struct mux_msg m;
+    unsigned char reply[MUX_REPLY_MAX];
+
+    _mux_start(&m,MUX_C_TERMINATE);
+    return (_mux_request(fd,&m,reply,sizeof(reply)) == MUX_S_OK) ? 0 : -1;
+}
+
+static int _mux_fwd (int fd, uint32_t type, const char *bind, int port,
+                     const char *host, int hostport)
+{
+    struct mux_msg m;
+    unsigned char reply[MUX_REPLY_MAX];
+
+    _mux_start(&m,type);
+    _mux_put32(&m,MUX_FWD_LOCAL);
+    _mux_putstr(&m,bind != NULL ? bind : "");
+    _mux_put32(&m,port);
+    _mux_putstr(&m,host);
+    _mux_put32(&m,hostport);
+    return (_mux_request(fd,&m,reply,sizeof(reply)) == MUX_S_OK) ? 0 : -1;
+}
+
+int mux_forward (int fd, const char *bind, int port, const char *host, int hostport)
+{
+    return _mux_fwd(fd,MUX_C_OPEN_FWD,bind,port,host,hostport);
+}
+
+int mux_cancel (int fd, const char *bind, int port, const char *host, int hostport)
+{
+    return _mux_fwd(fd,MUX_C_CLOSE_FWD,bind,port,host,hostport);
+}
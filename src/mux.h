@@ -0,0 +1,63 @@
+/***************************************************************************\
+ mux.h - client side of the OpenSSH ControlMaster protocol
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_MUX_H
+#define _SPUNNEL_MUX_H
+
+#include <sys/types.h>
+
+/*
+ * Connects to the ssh control master listening on path and does the hello
+ * exchange.  Returns the connected fd or -1 if no master answers there.
+ *
+ * The master counts every connected client as activity, so holding the fd
+ * open keeps a ControlPersist master from expiring while it is in use.
+ */
+int mux_connect(const char *path);
+
+/*
+ * Same, giving up when the connect and hello, or any later request with
+ * its reply, take longer than msec altogether rather than the default few
+ * seconds
+ */
+int mux_connect_timeout(const char *path, int msec);
+
+/*
+ * Requests on a connection from mux_connect, each a single round trip.  They
+ * return 0 if the master did what was asked.
+ *
+ * mux_check asks whether the master is alive and for its pid.  mux_exit
+ * tells it to exit.  mux_forward adds the equivalent of
+ * ssh -L [bind:]port:host:hostport to it and mux_cancel takes that away
+ * again; a NULL bind is ssh's default, the loopback address.  With port
+ * MUX_PORT_UNIX, bind is the path of a unix socket to listen on instead.
+ */
+#define MUX_PORT_UNIX (-2)
+
+int mux_check(int fd, pid_t *pid);
+int mux_exit(int fd);
+int mux_forward(int fd, const char *bind, int port, const char *host, int hostport);
+int mux_cancel(int fd, const char *bind, int port, const char *host, int hostport);
+
+#endif
@@ -0,0 +1,96 @@
+/***************************************************************************\
+ ports.c - choosing free ports on the submit host
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ports.h"
+
+#define TCP_TIME_WAIT 6
+
+static int _port_used (struct port_table *t, int port)
+{
+    return t->used[port / 8] & (1 << (port % 8));
+}
+
+static void _port_set (struct port_table *t, int port)
+{
+    t->used[port / 8] |= 1 << (port % 8);
+}
+
+/*
+ * Lines look like
+ *   sl  local_address rem_address   st tx_queue rx_queue ...
+ *    0: 0100007F:1F90 00000000:0000 0A 00000000:00000000 ...
+ * with the local port and the state in hex.
+ */
+static int _scan_file (struct port_table *t, const char *path)
+{
+    char line[512];
+    unsigned int port, state;
+    FILE *f;
+
+    if ((f = fopen(path,"re")) == NULL)
+        return -1;
+    if (fgets(line,sizeof(line),f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    while (fgets(line,sizeof(line),f) != NULL) {
+        if (sscanf(line," %*d: %*[0-9A-Fa-f]:%x %*[0-9A-Fa-f]:%*x %x",&port,&state) != 2)
+            continue;
+        if (state != TCP_TIME_WAIT && port < 65536)
+            _port_set(t,port);
+    }
+    fclose(f);
+    return 0;
+}
+
+int port_table_scan (struct port_table *t)
+{
+    memset(t->used,0,sizeof(t->used));
+    // tcp6 is missing when IPv6 is disabled
+    if (_scan_file(t,"/proc/net/tcp") != 0)
+        return -1;
+    _scan_file(t,"/proc/net/tcp6");
+    t->scanned = 1;
+    return 0;
+}
+
+int port_table_pick (struct port_table *t, int lo, int hi)
+{
+    int i, port, n = hi - lo + 1;
+
+    if (n <= 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        port = lo + (getpid() + i) % n;
+        if (!_port_used(t,port)) {
+            _port_set(t,port);
+            return port;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,52 @@
+/***************************************************************************\
+ ports.h - choosing free ports on the submit host
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_PORTS_H
+#define _SPUNNEL_PORTS_H
+
+#include <stdint.h>
+
+/*
+ * Which TCP ports are taken on this host, one bit per port
+ */
+struct port_table {
+    uint8_t used[65536 / 8];
+    int     scanned;
+};
+
+/*
+ * Fills the table from the kernel's socket tables (/proc/net/tcp and tcp6)
+ * in one pass.  Sockets in TIME_WAIT do not count, a listener can still be
+ * bound over them.  Returns 0 on success.
+ */
+int port_table_scan(struct port_table *t);
+
+/*
+ * Returns a free port between lo and hi, inclusive, and marks it taken, or
+ * -1 if there is none.  The search starts at a place that differs between
+ * processes so that sruns started together do not all pick the same port.
+ */
+int port_table_pick(struct port_table *t, int lo, int hi);
+
+#endif
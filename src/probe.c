@@ -0,0 +1,131 @@
+/***************************************************************************\
+ probe.c - readiness probes for forwarded ports
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spunnel.h"
+#include "probe.h"
+
+/*
+ * First and largest delay between probe rounds, in milliseconds, how long
+ * one connect may take and how long a connection through ssh has to stay up
+ */
+#define PROBE_DELAY_MIN  100
+#define PROBE_DELAY_MAX  5000
+#define PROBE_CONNECT_MS 1000
+#define PROBE_SETTLE_MS  250
+
+static double _now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * One attempt.  Returns 1 if the target answered.
+ */
+static int _probe_once (struct probe_target *t)
+{
+    struct pollfd pfd;
+    socklen_t len = sizeof(int);
+    int fd, err = 0, ready = 0;
+    char c;
+
+    fd = socket(t->addr.ss_family,SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,0);
+    if (fd < 0)
+        return 0;
+    if (connect(fd,(struct sockaddr *)&t->addr,t->addrlen) != 0) {
+        if (errno != EINPROGRESS)
+            goto done;
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if (poll(&pfd,1,PROBE_CONNECT_MS) != 1 ||
+            getsockopt(fd,SOL_SOCKET,SO_ERROR,&err,&len) != 0 || err != 0)
+            goto done;
+    }
+
+    ready = 1;
+    if (t->tunnel) {
+        // ssh closes it at once when the exec port refuses the channel
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd,1,PROBE_SETTLE_MS) == 1 &&
+            (pfd.revents & (POLLHUP | POLLERR) || recv(fd,&c,1,MSG_PEEK) <= 0))
+            ready = 0;
+    }
+
+    done:
+    close(fd);
+    return ready;
+}
+
+int probe_wait (struct probe_target *targets, int n, int timeout, int stop)
+{
+    unsigned int seed = getpid() ^ (unsigned int)time(NULL);
+    struct pollfd pfd = { stop, POLLIN, 0 };
+    double start = _now(), left;
+    int i, ms, delay = PROBE_DELAY_MIN, pending = n;
+
+    while (1) {
+        for (i = 0; i < n; i++) {
+            if (targets[i].ready || !_probe_once(&targets[i]))
+                continue;
+            targets[i].ready = 1;
+            targets[i].ready_after = _now() - start;
+            INFO("spunnel: %s ready after %.2fs",targets[i].name,targets[i].ready_after);
+            pending--;
+        }
+        left = timeout - (_now() - start);
+        if (pending == 0 || left <= 0)
+            break;
+
+        // sleep between half and all of delay, so that many sruns started
+        // together do not probe in lockstep
+        ms = delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+        if (poll(&pfd,stop >= 0,ms < left * 1000 ? ms : (int)(left * 1000)) > 0) {
+            INFO("spunnel: stopped waiting for %d port(s) to answer",pending);
+            return pending;
+        }
+        delay = (delay * 2 > PROBE_DELAY_MAX) ? PROBE_DELAY_MAX : delay * 2;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!targets[i].ready)
+            ERROR("spunnel: %s not ready after %ds",targets[i].name,timeout);
+    }
+    return pending;
+}
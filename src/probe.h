@@ -0,0 +1,55 @@
+/***************************************************************************\
+ probe.h - readiness probes for forwarded ports
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_PROBE_H
+#define _SPUNNEL_PROBE_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+ * Something to connect to until it answers.  A port forwarded by ssh -L is
+ * probed through the tunnel: ssh accepts the connection whether or not the
+ * exec port is listening and drops it right away if it is not, so a target
+ * with tunnel set only counts as ready if the connection stays up for a
+ * moment.  Other targets are ready as soon as connect() succeeds.
+ */
+struct probe_target {
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+    int                     tunnel;
+    char                    name[128];
+    int                     ready;
+    double                  ready_after;    // seconds
+};
+
+/*
+ * Probes every target until it is ready or timeout seconds have passed,
+ * backing off exponentially (with jitter) between rounds, and logs how
+ * long each one took.  It gives up early once stop, unless it is -1,
+ * becomes readable.  Returns how many targets are still not ready.
+ */
+int probe_wait(struct probe_target *targets, int n, int timeout, int stop);
+
+#endif
@@ -0,0 +1,483 @@
+/***************************************************************************\
+ reap.c - spunnel-reap, cleans up after spunnel sessions that died
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * Meant to run from cron on login nodes, as root.  It goes through the
+ * files the plugin leaves in /tmp, all named <user>-...tunnel after the
+ * user that owns them:
+ *
+ *   <user>-<host>-control.tunnel     ssh control masters
+ *   <user>-<job>-nodes.tunnel        node list caches
+ *   <user>-<job>.<step>-...tunnel    shim sockets and status files
+ *
+ * A control socket nobody listens on is removed.  A master that answers
+ * (one mux round trip) is told to exit if its user has no running job on
+ * its host.  The job files go once their job has ended.  Which jobs run
+ * where is asked of slurmctld once, and only if something needs it.  The
+ * control lock files are left alone: they are empty, and removing one
+ * that a starting session is waiting on would let two masters start.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <slurm/slurm.h>
+
+#include "mux.h"
+
+#define DEFAULT_DIR     "/tmp"
+#define CONTROL_SUFFIX  "-control.tunnel"
+
+/*
+ * How long a control socket gets to answer.  Anyone can leave sockets in
+ * /tmp that never do, and spunnel-reap must get through them well within
+ * the minute between cron runs.
+ */
+#define MASTER_TIMEOUT_MS 250
+
+/*
+ * What was found in the directory
+ */
+enum reap_kind {
+    REAP_CONTROL,
+    REAP_JOB
+};
+
+struct reap_file {
+    enum reap_kind kind;
+    char          *name;
+    uid_t          uid;
+    const char    *user;
+    char          *host;    // REAP_CONTROL
+    uint32_t       jobid;   // REAP_JOB
+    int            dir;     // REAP_JOB that is a session's socket directory
+    pid_t          pid;     // master of a live REAP_CONTROL, else 0
+};
+
+/*
+ * Running jobs, from the one slurm_load_jobs
+ */
+struct reap_job {
+    uint32_t   jobid;
+    uid_t      uid;
+    char      *nodes;
+    hostlist_t hl;          // made from nodes when first needed
+    int        have_hl;
+};
+
+static struct reap_job *jobs = NULL;
+static int njobs = 0;
+
+static int dry_run = 0;
+static int list = 0;
+
+/*
+ * User names by uid, since the same few owners own most files and the
+ * passwd lookup may go over the network
+ */
+struct reap_user {
+    uid_t uid;
+    char *name;
+};
+
+static struct reap_user *users = NULL;
+static int nusers = 0;
+static int users_size = 0;
+
+static const char *_user_name (uid_t uid)
+{
+    struct reap_user *tmp;
+    struct passwd *pw;
+    int i;
+
+    for (i = 0; i < nusers; i++) {
+        if (users[i].uid == uid)
+            return users[i].name;
+    }
+    if (nusers == users_size) {
+        users_size = users_size ? 2 * users_size : 64;
+        if ((tmp = realloc(users,users_size * sizeof(*users))) == NULL)
+            return NULL;
+        users = tmp;
+    }
+    pw = getpwuid(uid);
+    users[nusers].uid = uid;
+    users[nusers].name = (pw != NULL) ? strdup(pw->pw_name) : NULL;
+    return users[nusers++].name;
+}
+
+/*
+ * Works out what entry name of dir is.  Returns 0 and fills f if it is one
+ * of the plugin's files, owned by the user it is named after.
+ */
+static int _classify (int dir, const char *name, struct reap_file *f)
+{
+    struct stat st;
+    const char *rest;
+    size_t len, ulen;
+    unsigned job, step;
+    int n;
+
+    // files end in .tunnel, mkdtemp'd directories have .tunnel. before
+    // the random part
+    len = strlen(name);
+    if ((len < 7 || strcmp(name + len - 7,".tunnel") != 0) &&
+        (len < 14 || strncmp(name + len - 14,".tunnel.",8) != 0))
+        return -1;
+    if (fstatat(dir,name,&st,AT_SYMLINK_NOFOLLOW) != 0 ||
+        (f->user = _user_name(st.st_uid)) == NULL)
+        return -1;
+    ulen = strlen(f->user);
+    if (strncmp(name,f->user,ulen) != 0 || name[ulen] != '-')
+        return -1;
+    rest = name + ulen + 1;
+    len = strlen(rest);
+
+    memset(f,0,sizeof(*f));
+    f->user = _user_name(st.st_uid);
+    f->uid = st.st_uid;
+    if (len > strlen(CONTROL_SUFFIX) &&
+        strcmp(rest + len - strlen(CONTROL_SUFFIX),CONTROL_SUFFIX) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+            return -1;
+        f->kind = REAP_CONTROL;
+        f->host = strndup(rest,len - strlen(CONTROL_SUFFIX));
+    }
+    else if ((n = -1, sscanf(rest,"%u-nodes.tunnel%n",&job,&n) == 1 && n == len) ||
+             (n = -1, sscanf(rest,"%u.%u-status.tunnel%n",&job,&step,&n) == 2 && n == len) ||
+             (n = -1, sscanf(rest,"%u.%u-exec%*d.tunnel%n",&job,&step,&n) == 2 && n == len) ||
+             (n = -1, sscanf(rest,"%u.%u-%*d.tunnel%n",&job,&step,&n) == 2 && n == len)) {
+        f->kind = REAP_JOB;
+        f->jobid = job;
+    }
+    else if (S_ISDIR(st.st_mode) &&
+             ((n = -1, sscanf(rest,"%u.%u.tunnel.%*6[A-Za-z0-9]%n",&job,&step,&n) == 2 && n == len) ||
+              (n = -1, sscanf(rest,"%u-exec.tunnel%n",&job,&n) == 1 && n == len))) {
+        f->kind = REAP_JOB;
+        f->jobid = job;
+        f->dir = 1;
+    }
+    else
+        return -1;
+    f->name = strdup(name);
+    return (f->name != NULL && (f->kind != REAP_CONTROL || f->host != NULL)) ? 0 : -1;
+}
+
+/*
+ * Asks slurmctld for all jobs at once and keeps the running ones
+ */
+static int _load_jobs (void)
+{
+    job_info_msg_t *msg;
+    job_info_t *job;
+    uint32_t i;
+
+    if (slurm_load_jobs(0,&msg,SHOW_ALL) != 0) {
+        fprintf(stderr,"spunnel-reap: unable to load jobs: %s\n",
+                slurm_strerror(slurm_get_errno()));
+        return -1;
+    }
+    if ((jobs = calloc(msg->record_count + 1,sizeof(*jobs))) == NULL) {
+        slurm_free_job_info_msg(msg);
+        return -1;
+    }
+    for (i = 0; i < msg->record_count; i++) {
+        job = &msg->job_array[i];
+        if ((job->job_state & JOB_STATE_BASE) != JOB_RUNNING &&
+            (job->job_state & JOB_STATE_BASE) != JOB_SUSPENDED &&
+            !(job->job_state & JOB_COMPLETING))
+            continue;
+        jobs[njobs].jobid = job->job_id;
+        jobs[njobs].uid = job->user_id;
+        jobs[njobs].nodes = job->nodes ? strdup(job->nodes) : NULL;
+        njobs++;
+    }
+    slurm_free_job_info_msg(msg);
+    return 0;
+}
+
+static int _job_running (uint32_t jobid)
+{
+    int i;
+
+    for (i = 0; i < njobs; i++) {
+        if (jobs[i].jobid == jobid)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Whether uid has a running job with host among its nodes
+ */
+static int _user_on_host (uid_t uid, const char *host)
+{
+    struct reap_job *job;
+    int i;
+
+    for (i = 0; i < njobs; i++) {
+        job = &jobs[i];
+        if (job->uid != uid || job->nodes == NULL)
+            continue;
+        if (!job->have_hl) {
+            job->hl = slurm_hostlist_create(job->nodes);
+            job->have_hl = 1;
+        }
+        if (job->hl != NULL && slurm_hostlist_find(job->hl,host) >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Whether anything listens on the unix socket path.  Only a refused
+ * connection counts as nobody, a busy master may just be slow.
+ */
+static int _listening (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd, rc = 1;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 1;
+    strcpy(addr.sun_path,path);
+    if ((fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,0)) < 0)
+        return 1;
+    if (connect(fd,(struct sockaddr *)&addr,sizeof(addr)) != 0 &&
+        (errno == ECONNREFUSED || errno == ENOENT))
+        rc = 0;
+    close(fd);
+    return rc;
+}
+
+/*
+ * Connects to the master on the control socket of f, if it is the file's
+ * owner listening there (_classify already saw to it that the owner is the
+ * user the file is named after).  A uid with a socket that did not answer
+ * gets no more tries in this run, so whoever makes many silent sockets
+ * only costs one timeout.
+ */
+static int _master_connect (const char *path, struct reap_file *f)
+{
+    static uid_t *silent = NULL;
+    static int nsilent = 0;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    uid_t *tmp;
+    int i, fd;
+
+    for (i = 0; i < nsilent; i++) {
+        if (silent[i] == f->uid)
+            return -1;
+    }
+    if ((fd = mux_connect_timeout(path,MASTER_TIMEOUT_MS)) < 0) {
+        if ((tmp = realloc(silent,(nsilent + 1) * sizeof(uid_t))) != NULL) {
+            silent = tmp;
+            silent[nsilent++] = f->uid;
+        }
+        return -1;
+    }
+    if (getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&len) != 0 || cred.uid != f->uid) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Empties a session's socket directory.  It is opened without following
+ * links and emptied through its fd, so its owner can't point us anywhere
+ * else.
+ */
+static void _empty_dir (int dir, const char *name)
+{
+    struct dirent *ent;
+    DIR *dirp;
+    int fd;
+
+    if ((fd = openat(dir,name,O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        return;
+    if ((dirp = fdopendir(fd)) == NULL) {
+        close(fd);
+        return;
+    }
+    while ((ent = readdir(dirp)) != NULL) {
+        if (strcmp(ent->d_name,".") != 0 && strcmp(ent->d_name,"..") != 0)
+            unlinkat(fd,ent->d_name,0);
+    }
+    closedir(dirp);
+}
+
+static void _remove (int dir, const char *path, struct reap_file *f, const char *why)
+{
+    printf("%s %s (%s)\n",dry_run ? "would remove" : "removed",path,why);
+    if (dry_run)
+        return;
+    if (f->dir)
+        _empty_dir(dir,f->name);
+    if (unlinkat(dir,f->name,f->dir ? AT_REMOVEDIR : 0) != 0 && errno != ENOENT)
+        fprintf(stderr,"spunnel-reap: unable to remove %s: %s\n",path,strerror(errno));
+}
+
+static void _stop_master (int fd, const char *path, struct reap_file *f)
+{
+    if (!dry_run && mux_exit(fd) != 0) {
+        fprintf(stderr,"spunnel-reap: unable to stop the master on %s\n",path);
+        return;
+    }
+    printf("%s the ssh master of %s to %s (pid %d, no job there)\n",
+           dry_run ? "would stop" : "stopped",f->user,f->host,(int)f->pid);
+}
+
+static void _usage (void)
+{
+    fprintf(stderr,"usage: spunnel-reap [-n] [-l] [-d dir]\n"
+            "  -n      only say what would be cleaned up\n"
+            "  -l      list every spunnel file found, and its state\n"
+            "  -d dir  where the plugin keeps its files (default " DEFAULT_DIR ")\n");
+}
+
+int main (int argc, char **argv)
+{
+    struct reap_file *files = NULL, *tmp, *f;
+    struct dirent *ent;
+    char path[1024];
+    const char *dirname = DEFAULT_DIR;
+    DIR *dirp;
+    int nfiles = 0, files_size = 0;
+    int i, c, fd, dir, need_jobs = 0, have_jobs = 0, status = 0;
+
+    while ((c = getopt(argc,argv,"nld:h")) != -1) {
+        switch (c) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'l':
+            list = 1;
+            break;
+        case 'd':
+            dirname = optarg;
+            break;
+        default:
+            _usage();
+            return (c == 'h') ? 0 : 2;
+        }
+    }
+
+    if ((dirp = opendir(dirname)) == NULL) {
+        fprintf(stderr,"spunnel-reap: unable to open %s: %s\n",dirname,strerror(errno));
+        return 1;
+    }
+    dir = dirfd(dirp);
+    while ((ent = readdir(dirp)) != NULL) {
+        if (nfiles == files_size) {
+            files_size = files_size ? 2 * files_size : 256;
+            if ((tmp = realloc(files,files_size * sizeof(*files))) == NULL) {
+                fprintf(stderr,"spunnel-reap: out of memory\n");
+                return 1;
+            }
+            files = tmp;
+        }
+        if (_classify(dir,ent->d_name,&files[nfiles]) == 0)
+            nfiles++;
+    }
+
+    // the cheap checks first: dead control sockets and masters' pids
+    for (i = 0; i < nfiles; i++) {
+        f = &files[i];
+        snprintf(path,sizeof(path),"%s/%s",dirname,f->name);
+        if (f->kind == REAP_JOB) {
+            need_jobs = 1;
+            continue;
+        }
+        if (!_listening(path)) {
+            if (list)
+                printf("%-8s %-12s %-24s stale\n","control",f->user,f->host);
+            _remove(dir,path,f,"no ssh master");
+            continue;
+        }
+        if ((fd = _master_connect(path,f)) >= 0) {
+            if (mux_check(fd,&f->pid) != 0)
+                f->pid = 0;
+            close(fd);
+        }
+        if (f->pid > 0)
+            need_jobs = 1;
+        else if (list)
+            printf("%-8s %-12s %-24s not answering\n","control",f->user,f->host);
+    }
+
+    if (need_jobs) {
+        if (_load_jobs() == 0)
+            have_jobs = 1;
+        else
+            status = 1;
+    }
+
+    for (i = 0; have_jobs && i < nfiles; i++) {
+        f = &files[i];
+        snprintf(path,sizeof(path),"%s/%s",dirname,f->name);
+        if (f->kind == REAP_JOB) {
+            if (list)
+                printf("%-8s %-12s %-24u %s\n","job",f->user,f->jobid,
+                       _job_running(f->jobid) ? "running" : "ended");
+            if (!_job_running(f->jobid))
+                _remove(dir,path,f,"job has ended");
+            continue;
+        }
+        if (f->pid <= 0)
+            continue;
+        if (_user_on_host(f->uid,f->host)) {
+            if (list)
+                printf("%-8s %-12s %-24s pid %d\n","control",f->user,f->host,(int)f->pid);
+            continue;
+        }
+        if (list)
+            printf("%-8s %-12s %-24s pid %d, orphaned\n","control",f->user,f->host,(int)f->pid);
+        if ((fd = _master_connect(path,f)) >= 0) {
+            _stop_master(fd,path,f);
+            close(fd);
+        }
+    }
+
+    closedir(dirp);
+    return status;
+}
@@ -0,0 +1,326 @@
+/***************************************************************************\
+ registry.c - login node wide registry of the submit ports spunnel holds
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spunnel.h"
+#include "registry.h"
+
+#define REGISTRY_MAGIC   0x73706e72    // "spnr"
+#define REGISTRY_VERSION 1
+#define REGISTRY_PORTS   65536
+
+/*
+ * owner is pid << 32 | uid, 0 when the slot is free.  heartbeat is in
+ * CLOCK_BOOTTIME seconds, which all processes on the host share; it is 0
+ * from a release until the next owner has stored its own.
+ */
+struct registry_slot {
+    _Atomic uint64_t owner;
+    _Atomic uint64_t heartbeat;
+    _Atomic uint32_t jobid;
+    uint32_t         unused;
+};
+
+struct registry_file {
+    _Atomic uint32_t     magic;
+    uint32_t             version;
+    uint8_t              pad[56];
+    struct registry_slot slots[REGISTRY_PORTS];
+};
+
+static struct registry_file *reg = NULL;
+
+// for the slots claimed from now on, see registry_set_job
+static uint32_t reg_jobid = 0;
+
+/*
+ * The ports this process has claimed, for the heartbeat thread
+ */
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *held = NULL;
+static int nheld = 0;
+static int held_size = 0;
+
+static pthread_t heartbeat_thread;
+static int heartbeat_stop = -1;     // closed to stop the thread
+
+static uint64_t _now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME,&ts);
+    return ts.tv_sec + 1;   // never 0
+}
+
+static uint64_t _me (void)
+{
+    return (uint64_t)getpid() << 32 | getuid();
+}
+
+static void _owner (uint64_t owner, struct registry_slot *slot,
+                    struct registry_owner *who)
+{
+    if (who == NULL)
+        return;
+    who->uid = owner & 0xffffffff;
+    who->pid = owner >> 32;
+    who->jobid = atomic_load(&slot->jobid);
+}
+
+/*
+ * A slot is stale when its heartbeat stopped, or right away when its owner
+ * is gone (a killed srun cannot release anything) or is not who the slot
+ * says: a pid reused by another user, or one written in to block the port
+ */
+static int _stale (uint64_t owner, uint64_t heartbeat, uint64_t now)
+{
+    struct stat st;
+    char proc[32];
+
+    if (heartbeat != 0 && (now - heartbeat > REGISTRY_STALE ||
+                           heartbeat > now + REGISTRY_HEARTBEAT))
+        return 1;
+    snprintf(proc,sizeof(proc),"/proc/%u",(unsigned int)(owner >> 32));
+    if (stat(proc,&st) == 0)
+        return st.st_uid != (uid_t)(owner & 0xffffffff);
+    // /proc mounted with hidepid= leaves other users' processes out
+    return kill(owner >> 32,0) != 0 && errno == ESRCH;
+}
+
+int registry_open (const char *path)
+{
+    struct registry_file *r;
+    struct stat st;
+    uint32_t magic = 0;
+    int fd;
+
+    if (reg != NULL)
+        return 0;
+    // created by root (see spunnel.tmpfiles), never by a user who could
+    // then truncate it under everybody else's mapping
+    if ((fd = open(path,O_RDWR|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+        DEBUG("spunnel: unable to open port registry %s: %s",path,strerror(errno));
+        return -1;
+    }
+    if (fstat(fd,&st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != 0 ||
+        (st.st_mode & S_IWOTH) ||
+        (st.st_size != 0 && st.st_size != sizeof(*r)) ||
+        (st.st_size == 0 && ftruncate(fd,sizeof(*r)) != 0)) {
+        ERROR("spunnel: %s is not a root owned port registry, not using it",path);
+        close(fd);
+        return -1;
+    }
+    r = mmap(NULL,sizeof(*r),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if (r == MAP_FAILED)
+        return -1;
+    if (!atomic_compare_exchange_strong(&r->magic,&magic,REGISTRY_MAGIC) &&
+        magic != REGISTRY_MAGIC) {
+        ERROR("spunnel: %s is not a port registry, not using it",path);
+        munmap(r,sizeof(*r));
+        return -1;
+    }
+    if (r->version == 0)
+        r->version = REGISTRY_VERSION;
+    if (r->version != REGISTRY_VERSION) {
+        ERROR("spunnel: port registry %s is version %u, not using it",path,r->version);
+        munmap(r,sizeof(*r));
+        return -1;
+    }
+    reg = r;
+    return 0;
+}
+
+static void *_heartbeat (void *arg)
+{
+    struct pollfd pfd = { (int)(intptr_t)arg, POLLIN, 0 };
+    uint64_t me, now;
+    int i, n;
+
+    for (;;) {
+        n = poll(&pfd,1,REGISTRY_HEARTBEAT * 1000);
+        if (n < 0 && errno == EINTR)
+            continue;
+        // the other end was closed by registry_close
+        if (n != 0)
+            break;
+        me = _me();
+        now = _now();
+        pthread_mutex_lock(&held_lock);
+        for (i = 0; i < nheld; i++) {
+            if (atomic_load(&reg->slots[held[i]].owner) == me)
+                atomic_store(&reg->slots[held[i]].heartbeat,now);
+        }
+        pthread_mutex_unlock(&held_lock);
+    }
+    close(pfd.fd);
+    return NULL;
+}
+
+static int _hold (int port)
+{
+    int fds[2], *p, size;
+
+    pthread_mutex_lock(&held_lock);
+    if (nheld == held_size) {
+        size = held_size ? held_size * 2 : 16;
+        if ((p = realloc(held,size * sizeof(int))) == NULL) {
+            pthread_mutex_unlock(&held_lock);
+            return -1;
+        }
+        held = p;
+        held_size = size;
+    }
+    held[nheld++] = port;
+    pthread_mutex_unlock(&held_lock);
+
+    if (heartbeat_stop >= 0)
+        return 0;
+    if (pipe2(fds,O_CLOEXEC) != 0)
+        return -1;
+    heartbeat_stop = fds[1];
+    if (pthread_create(&heartbeat_thread,NULL,_heartbeat,(void *)(intptr_t)fds[0]) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        heartbeat_stop = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int registry_claim (int port, struct registry_owner *who)
+{
+    struct registry_slot *slot;
+    uint64_t me, owner = 0, heartbeat, now;
+
+    if (reg == NULL || port <= 0 || port >= REGISTRY_PORTS)
+        return 0;
+    slot = &reg->slots[port];
+    me = _me();
+    now = _now();
+
+    if (!atomic_compare_exchange_strong(&slot->owner,&owner,me)) {
+        if (owner == me)
+            return 0;
+        heartbeat = atomic_load(&slot->heartbeat);
+        if (!_stale(owner,heartbeat,now)) {
+            _owner(owner,slot,who);
+            return -1;
+        }
+        // whoever moves the heartbeat on gets to take the slot over
+        if (!atomic_compare_exchange_strong(&slot->heartbeat,&heartbeat,now) ||
+            !atomic_compare_exchange_strong(&slot->owner,&owner,me)) {
+            _owner(owner,slot,who);
+            return -1;
+        }
+        INFO("spunnel: reclaimed port %d from pid %u of uid %u",port,
+             (unsigned int)(owner >> 32),(unsigned int)(owner & 0xffffffff));
+    }
+    atomic_store(&slot->jobid,reg_jobid);
+    atomic_store(&slot->heartbeat,now);
+    if (_hold(port) != 0)
+        ERROR("spunnel: unable to keep the registry heartbeat for port %d",port);
+    return 0;
+}
+
+void registry_set_job (uint32_t jobid)
+{
+    uint64_t me = _me();
+    int i;
+
+    reg_jobid = jobid;
+    if (reg == NULL)
+        return;
+    pthread_mutex_lock(&held_lock);
+    for (i = 0; i < nheld; i++) {
+        if (atomic_load(&reg->slots[held[i]].owner) == me)
+            atomic_store(&reg->slots[held[i]].jobid,jobid);
+    }
+    pthread_mutex_unlock(&held_lock);
+}
+
+static void _release (int port, uint64_t me)
+{
+    struct registry_slot *slot = &reg->slots[port];
+    uint64_t owner = me;
+
+    if (atomic_load(&slot->owner) != me)
+        return;
+    atomic_store(&slot->heartbeat,0);
+    atomic_compare_exchange_strong(&slot->owner,&owner,0);
+}
+
+void registry_release (int port)
+{
+    int i;
+
+    if (reg == NULL || port <= 0 || port >= REGISTRY_PORTS)
+        return;
+    _release(port,_me());
+    pthread_mutex_lock(&held_lock);
+    for (i = 0; i < nheld; i++) {
+        if (held[i] == port) {
+            held[i] = held[--nheld];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&held_lock);
+}
+
+void registry_close (void)
+{
+    uint64_t me = _me();
+    int i;
+
+    if (reg == NULL)
+        return;
+    if (heartbeat_stop >= 0) {
+        close(heartbeat_stop);
+        pthread_join(heartbeat_thread,NULL);
+        heartbeat_stop = -1;
+    }
+    for (i = 0; i < nheld; i++)
+        _release(held[i],me);
+    free(held);
+    held = NULL;
+    nheld = held_size = 0;
+    munmap(reg,sizeof(*reg));
+    reg = NULL;
+}
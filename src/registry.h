@@ -0,0 +1,85 @@
+/***************************************************************************\
+ registry.h - login node wide registry of the submit ports spunnel holds
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_REGISTRY_H
+#define _SPUNNEL_REGISTRY_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+/*
+ * The registry is a file in /dev/shm that every srun on the login node maps,
+ * with one slot per TCP port saying which srun (pid and uid) holds it, for
+ * which job, and when that srun last said it was alive.  Slots are claimed
+ * and released with compare-and-swap, so there is no lock to wait for or to
+ * be left behind by a killed srun.  A slot whose heartbeat is older than
+ * REGISTRY_STALE seconds is up for grabs.
+ *
+ * It only coordinates spunnel sessions with each other.  Whoever binds a
+ * port first still gets it, so a claimed port must be bound as well.
+ *
+ * Everyone who can write the file can also truncate it, which would kill
+ * every process mapping it with SIGBUS, so it has to be made by root
+ * (spunnel.tmpfiles has systemd-tmpfiles do it) and writable only by the
+ * group of users that run srun.
+ */
+#define REGISTRY_HEARTBEAT  10
+#define REGISTRY_STALE      60
+
+struct registry_owner {
+    uid_t    uid;
+    pid_t    pid;
+    uint32_t jobid;
+};
+
+/*
+ * Maps the registry at path, sizing it if it is still empty.  A path that
+ * does not exist, is not owned by root or is writable by others is not
+ * used.  Until it is open (or when that failed) every claim succeeds,
+ * leaving it to bind() alone.  Returns 0 on success.
+ */
+int registry_open(const char *path);
+
+/*
+ * Claims port for this process.  Returns 0 if the port is ours now, and -1
+ * if a live session holds it, which is then described in who (if not NULL).
+ * The first claim starts a thread that keeps the heartbeat of this
+ * process's slots fresh.
+ */
+int registry_claim(int port, struct registry_owner *who);
+
+/*
+ * Records the job this process's ports are for, once it is known, both in
+ * the slots it holds and in those it claims later.
+ */
+void registry_set_job(uint32_t jobid);
+
+void registry_release(int port);
+
+/*
+ * Releases every port this process holds and stops the heartbeat.
+ */
+void registry_close(void);
+
+#endif
@@ -0,0 +1,913 @@
+/***************************************************************************\
+ relay.c - in-process TCP relay for spunnel's native transport
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+/*
+ * The relay is what transport=native uses in place of ssh -L.  Every
+ * listening socket is paired with an exec host address; each accepted
+ * client gets its own non-blocking connection to that address and bytes
+ * are shuffled between the two with a single level-triggered epoll loop.
+ *
+ * Data is moved with splice() through a pipe per direction, so payload is
+ * never copied into userspace.  Pipes come from a small pool kept by the
+ * relay.  Where splice is not available (old kernels, seccomp, socket types
+ * it does not support) a connection falls back to recv/send on buffers.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "spunnel.h"
+#include "relay.h"
+#include "relay_impl.h"
+
+/*
+ * Per direction buffer size, how many events one epoll_wait returns and how
+ * many idle pipes are kept around for new connections
+ */
+#define RELAY_BUF_SIZE   65536
+#define RELAY_MAX_EVENTS 64
+#define RELAY_PIPE_POOL  64
+
+struct relay_conn;
+
+/*
+ * One socket of a relayed connection; side 0 is the accepted client,
+ * side 1 the connection to the exec host.
+ */
+struct relay_end {
+    enum relay_kind    kind;
+    struct relay_conn *conn;
+    int                side;
+};
+
+/*
+ * Bytes read from one side, waiting to be written to the other.  They sit
+ * in pipe when the connection splices, in buf otherwise.
+ */
+struct relay_chan {
+    char   *buf;
+    int     pipe[2];
+    size_t  off;
+    size_t  len;
+    int     eof;
+};
+
+struct relay_pipe {
+    int                fd[2];
+    struct relay_pipe *next;
+};
+
+struct relay_conn {
+    struct relay_listener *l;
+    int               fd[2];
+    uint32_t          events[2];
+    struct relay_end  end[2];
+    struct relay_chan chan[2];   // chan[i] carries data read from fd[i]
+    int               connecting;
+    int               splice;
+    int               dead;
+    struct relay_conn *next_dead;
+    struct relay_conn *prev;     // on r->conns while not dead
+    struct relay_conn *next;
+};
+
+static void _conn_close(struct relay *r, struct relay_conn *c);
+static void _reap_dead(struct relay *r);
+
+struct relay *relay_create(void)
+{
+    struct relay *r = calloc(1, sizeof(struct relay));
+    if (r == NULL)
+        return NULL;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        ERROR("spunnel: relay: epoll_create1: %s",strerror(errno));
+        free(r);
+        return NULL;
+    }
+    r->splice_ok = 1;
+    r->stop = -1;
+    return r;
+}
+
+void relay_destroy(struct relay *r)
+{
+    struct relay_listener *l, *next;
+    struct relay_pipe *p;
+
+    if (r == NULL)
+        return;
+    // the connections still open when it stopped (io_uring closes its own)
+    while (r->conns != NULL)
+        _conn_close(r,r->conns);
+    _reap_dead(r);
+    for (l = r->listeners; l != NULL; l = next) {
+        next = l->next;
+        close(l->fd);
+        free(l);
+    }
+    while ((p = r->pipes) != NULL) {
+        r->pipes = p->next;
+        close(p->fd[0]);
+        close(p->fd[1]);
+        free(p);
+    }
+    close(r->epfd);
+    free(r);
+}
+
+static int _listen_addr(const struct sockaddr *addr, socklen_t addrlen, int shared)
+{
+    int one = 1;
+    int fd;
+
+    fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+    if (shared && setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (bind(fd,addr,addrlen) < 0 || listen(fd,SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int _listen_port(int port, int shared)
+{
+    struct sockaddr_in addr;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    return _listen_addr((struct sockaddr *)&addr,sizeof(addr),shared);
+}
+
+int relay_listen(int port)
+{
+    return _listen_port(port,0);
+}
+
+int relay_listen_shared(int port)
+{
+    return _listen_port(port,1);
+}
+
+int relay_listen_unix(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path,path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    unlink(path);
+    if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) < 0 ||
+        listen(fd,SOMAXCONN) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int relay_resolve(const char *host, int port,
+                  struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    struct addrinfo hints, *res;
+    char service[16];
+    int rc;
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service,sizeof(service),"%d",port);
+
+    rc = getaddrinfo(host,service,&hints,&res);
+    if (rc != 0) {
+        ERROR("spunnel: relay: unable to resolve %s: %s",host,gai_strerror(rc));
+        return -1;
+    }
+    memcpy(addr,res->ai_addr,res->ai_addrlen);
+    *addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+int relay_add(struct relay *r, int lfd,
+              const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct epoll_event ev;
+    struct relay_listener *l;
+
+    if ((l = calloc(1,sizeof(struct relay_listener))) == NULL)
+        return -1;
+    l->kind = RELAY_LISTENER;
+    l->fd = lfd;
+    memcpy(&l->addr,addr,addrlen);
+    l->addrlen = addrlen;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    if (epoll_ctl(r->epfd,EPOLL_CTL_ADD,lfd,&ev) < 0) {
+        ERROR("spunnel: relay: unable to watch listener: %s",strerror(errno));
+        free(l);
+        return -1;
+    }
+    l->next = r->listeners;
+    r->listeners = l;
+    return 0;
+}
+
+/*
+ * Takes a pipe from the pool, or makes a new one.  Returns 0 on success.
+ */
+static int _pipe_get(struct relay *r, int fd[2])
+{
+    struct relay_pipe *p = r->pipes;
+
+    if (p != NULL) {
+        r->pipes = p->next;
+        r->npipes--;
+        fd[0] = p->fd[0];
+        fd[1] = p->fd[1];
+        free(p);
+        return 0;
+    }
+    return pipe2(fd,O_NONBLOCK | O_CLOEXEC);
+}
+
+/*
+ * Gives a pipe back to the pool.  Pipes that still hold data, or that do
+ * not fit in the pool, are closed.
+ */
+static void _pipe_put(struct relay *r, int fd[2], size_t pending)
+{
+    struct relay_pipe *p;
+
+    if (fd[0] < 0)
+        return;
+    if (pending == 0 && r->npipes < RELAY_PIPE_POOL &&
+        (p = malloc(sizeof(struct relay_pipe))) != NULL) {
+        p->fd[0] = fd[0];
+        p->fd[1] = fd[1];
+        p->next = r->pipes;
+        r->pipes = p;
+        r->npipes++;
+    }
+    else {
+        close(fd[0]);
+        close(fd[1]);
+    }
+    fd[0] = fd[1] = -1;
+}
+
+/*
+ * Switches a connection from splice to recv/send.  Anything already in the
+ * pipes is moved into the buffers first.  Returns -1 if that fails.
+ */
+static int _conn_copy_mode(struct relay *r, struct relay_conn *c)
+{
+    struct relay_chan *chan;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        chan = &c->chan[i];
+        if (chan->buf == NULL && (chan->buf = malloc(RELAY_BUF_SIZE)) == NULL)
+            return -1;
+        if (chan->pipe[0] >= 0 && chan->len > 0) {
+            n = read(chan->pipe[0],chan->buf,chan->len);
+            if (n != (ssize_t)chan->len)
+                return -1;
+        }
+        _pipe_put(r,chan->pipe,0);
+        chan->off = 0;
+    }
+    c->splice = 0;
+    return 0;
+}
+
+/*
+ * Closes both sockets of a connection.  The memory is only released by
+ * _reap_dead, after the current batch of events, because the batch may
+ * still hold an event for the other end.
+ */
+static void _conn_close(struct relay *r, struct relay_conn *c)
+{
+    int i;
+
+    if (c->dead)
+        return;
+    for (i = 0; i < 2; i++) {
+        if (c->fd[i] >= 0) {
+            epoll_ctl(r->epfd,EPOLL_CTL_DEL,c->fd[i],NULL);
+            close(c->fd[i]);
+            c->fd[i] = -1;
+        }
+        _pipe_put(r,c->chan[i].pipe,c->chan[i].len);
+    }
+    c->dead = 1;
+    c->next_dead = r->dead;
+    r->dead = c;
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        r->conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    relay_note_conn(r,c->l,-1);
+}
+
+static void _reap_dead(struct relay *r)
+{
+    struct relay_conn *c;
+
+    while ((c = r->dead) != NULL) {
+        r->dead = c->next_dead;
+        free(c->chan[0].buf);
+        free(c->chan[1].buf);
+        free(c);
+    }
+}
+
+/*
+ * Works out which events each side needs now and tells epoll about the
+ * ones that changed.  A side is read only while its buffer is empty, and
+ * watched for writability only while the other side's buffer is not.
+ * A side with nothing wanted is "parked" with EPOLLONESHOT, so a peer
+ * hangup does not keep firing while its data waits in our buffer.
+ */
+static int _conn_update(struct relay *r, struct relay_conn *c)
+{
+    struct epoll_event ev;
+    uint32_t want;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        want = 0;
+        if (!c->connecting && !c->chan[i].eof && c->chan[i].len == 0)
+            want |= EPOLLIN;
+        if (c->chan[!i].len > 0 || (i == 1 && c->connecting))
+            want |= EPOLLOUT;
+        if (want == c->events[i])
+            continue;
+        // a parked socket stays parked until it is wanted again
+        if (want == 0 && (c->events[i] & EPOLLONESHOT))
+            continue;
+        ev.events = want;
+        ev.data.ptr = &c->end[i];
+        if (epoll_ctl(r->epfd,EPOLL_CTL_MOD,c->fd[i],&ev) < 0)
+            return -1;
+        c->events[i] = want;
+    }
+    return 0;
+}
+
+/*
+ * Writes what is pending in chan[s] to the other side.  Once a channel is
+ * drained after EOF the write half of that socket is shut down so its peer
+ * sees the EOF too.  Returns -1 if the connection is broken.
+ */
+static int _chan_flush(struct relay *r, struct relay_conn *c, int s)
+{
+    struct relay_chan *chan = &c->chan[s];
+    int fd = c->fd[!s];
+    ssize_t n;
+
+    while (chan->len > 0) {
+        if (c->splice)
+            n = splice(chan->pipe[0],NULL,fd,NULL,chan->len,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            n = send(fd,chan->buf + chan->off,chan->len,MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            if (c->splice && (errno == EINVAL || errno == ENOSYS)) {
+                if (_conn_copy_mode(r,c) < 0)
+                    return -1;
+                continue;
+            }
+            return -1;
+        }
+        chan->off += n;
+        chan->len -= n;
+    }
+    chan->off = 0;
+    if (chan->eof)
+        shutdown(fd,SHUT_WR);
+    return 0;
+}
+
+/*
+ * Reads what fd[s] has into chan[s].  Only called while chan[s] is empty,
+ * so a pipe always has room for RELAY_BUF_SIZE bytes.
+ */
+static int _chan_fill(struct relay *r, struct relay_conn *c, int s)
+{
+    struct relay_chan *chan = &c->chan[s];
+    int fd = c->fd[s];
+    ssize_t n;
+
+    for (;;) {
+        if (c->splice)
+            n = splice(fd,NULL,chan->pipe[1],NULL,RELAY_BUF_SIZE,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        else
+            n = recv(fd,chan->buf,RELAY_BUF_SIZE,0);
+        if (n >= 0 || errno != EINTR)
+            break;
+    }
+
+    if (n < 0 && c->splice &&
+        (errno == EINVAL || errno == ENOSYS || errno == EPERM)) {
+        // splice can't be used here; the syscall itself may be missing
+        if (errno != EINVAL && r->splice_ok) {
+            DEBUG("spunnel: relay: splice unavailable, copying through userspace");
+            r->splice_ok = 0;
+        }
+        if (_conn_copy_mode(r,c) < 0)
+            return -1;
+        return _chan_fill(r,c,s);
+    }
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    if (n > 0)
+        relay_note_bytes(r,c->l,n);
+    if (n == 0)
+        chan->eof = 1;
+    chan->off = 0;
+    chan->len = n;
+    return 0;
+}
+
+static void _end_event(struct relay *r, struct relay_end *e, uint32_t events)
+{
+    struct epoll_event ev;
+    struct relay_conn *c = e->conn;
+    int s = e->side;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if (c->dead)
+        return;
+
+    if (c->connecting) {
+        // the only event expected is the upstream connect completing
+        if (getsockopt(c->fd[1],SOL_SOCKET,SO_ERROR,&err,&errlen) < 0 || err) {
+            DEBUG("spunnel: relay: connect to exec host failed: %s",
+                  strerror(err ? err : errno));
+            goto broken;
+        }
+        c->connecting = 0;
+        goto update;
+    }
+
+    if (events & EPOLLERR)
+        goto broken;
+    if ((events & EPOLLHUP) && !(c->events[s] & (EPOLLIN | EPOLLOUT))) {
+        // the peer has gone, but what it sent last may still be queued
+        ev.events = EPOLLONESHOT;
+        ev.data.ptr = e;
+        if (epoll_ctl(r->epfd,EPOLL_CTL_MOD,c->fd[s],&ev) < 0)
+            goto broken;
+        c->events[s] = EPOLLONESHOT;
+        return;
+    }
+
+    if ((events & (EPOLLIN | EPOLLHUP)) && (c->events[s] & EPOLLIN)) {
+        if (_chan_fill(r,c,s) < 0 || _chan_flush(r,c,s) < 0)
+            goto broken;
+    }
+    if (events & EPOLLOUT) {
+        if (_chan_flush(r,c,!s) < 0)
+            goto broken;
+    }
+
+    if (c->chan[0].eof && c->chan[1].eof &&
+        c->chan[0].len == 0 && c->chan[1].len == 0)
+        goto broken;
+
+update:
+    if (_conn_update(r,c) == 0)
+        return;
+
+broken:
+    _conn_close(r,c);
+}
+
+static void _accept(struct relay *r, struct relay_listener *l)
+{
+    struct epoll_event ev;
+    struct relay_conn *c;
+    int one = 1;
+    int fd, i;
+
+    for (;;) {
+        fd = accept4(l->fd,NULL,NULL,SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                ERROR("spunnel: relay: accept: %s",strerror(errno));
+            if (errno != EINTR)
+                return;
+            continue;
+        }
+
+        if ((c = calloc(1,sizeof(struct relay_conn))) == NULL) {
+            close(fd);
+            continue;
+        }
+        for (i = 0; i < 2; i++)
+            c->chan[i].pipe[0] = c->chan[i].pipe[1] = -1;
+        c->splice = r->splice_ok &&
+                    _pipe_get(r,c->chan[0].pipe) == 0 &&
+                    _pipe_get(r,c->chan[1].pipe) == 0;
+        if (!c->splice && _conn_copy_mode(r,c) < 0) {
+            for (i = 0; i < 2; i++) {
+                _pipe_put(r,c->chan[i].pipe,0);
+                free(c->chan[i].buf);
+            }
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->l = l;
+        c->next = r->conns;
+        if (r->conns != NULL)
+            r->conns->prev = c;
+        r->conns = c;
+        relay_note_conn(r,l,1);
+        c->fd[0] = fd;
+        c->fd[1] = socket(l->addr.ss_family,
+                          SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        for (i = 0; i < 2; i++) {
+            c->end[i].kind = RELAY_END;
+            c->end[i].conn = c;
+            c->end[i].side = i;
+        }
+        if (c->fd[1] < 0) {
+            _conn_close(r,c);
+            continue;
+        }
+        setsockopt(c->fd[0],IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+        setsockopt(c->fd[1],IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+        if (connect(c->fd[1],(struct sockaddr *)&l->addr,l->addrlen) < 0) {
+            if (errno != EINPROGRESS) {
+                DEBUG("spunnel: relay: connect to exec host failed: %s",
+                      strerror(errno));
+                _conn_close(r,c);
+                continue;
+            }
+            c->connecting = 1;
+        }
+
+        // register with no events, _conn_update sets the real ones
+        for (i = 0; i < 2; i++) {
+            ev.events = 0;
+            ev.data.ptr = &c->end[i];
+            epoll_ctl(r->epfd,EPOLL_CTL_ADD,c->fd[i],&ev);
+        }
+        if (_conn_update(r,c) < 0)
+            _conn_close(r,c);
+    }
+}
+
+static int _epoll_run(struct relay *r)
+{
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    enum relay_kind *kind;
+    int n, i, timeout, stopped = 0;
+
+    while (!stopped) {
+        if ((timeout = relay_idle_left(r)) == 0)
+            return 0;
+        n = epoll_wait(r->epfd,events,RELAY_MAX_EVENTS,timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ERROR("spunnel: relay: epoll_wait: %s",strerror(errno));
+            return -1;
+        }
+        for (i = 0; i < n; i++) {
+            kind = events[i].data.ptr;
+            // the rest of the batch is still handled, so that a later run
+            // does not lose the one-shot events in it
+            if (*kind == RELAY_STOP)
+                stopped = 1;
+            else if (*kind == RELAY_LISTENER)
+                _accept(r,events[i].data.ptr);
+            else
+                _end_event(r,events[i].data.ptr,events[i].events);
+        }
+        _reap_dead(r);
+    }
+    return 0;
+}
+
+void relay_set_idle(struct relay *r, int seconds)
+{
+    r->idle = seconds;
+    clock_gettime(CLOCK_MONOTONIC,&r->last_active);
+}
+
+int relay_remove(struct relay *r, int lfd)
+{
+    struct relay_listener **lp, *l;
+    struct relay_conn *c, *next;
+
+    for (lp = &r->listeners; *lp != NULL && (*lp)->fd != lfd; lp = &(*lp)->next)
+        ;
+    if ((l = *lp) == NULL)
+        return -1;
+    for (c = r->conns; c != NULL; c = next) {
+        next = c->next;
+        if (c->l == l)
+            _conn_close(r,c);
+    }
+    _reap_dead(r);
+    *lp = l->next;
+    epoll_ctl(r->epfd,EPOLL_CTL_DEL,l->fd,NULL);
+    close(l->fd);
+    free(l);
+    return 0;
+}
+
+int relay_set_stop(struct relay *r, int fd)
+{
+    struct epoll_event ev;
+
+    r->stop_kind = RELAY_STOP;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &r->stop_kind;
+    if (epoll_ctl(r->epfd,EPOLL_CTL_ADD,fd,&ev) < 0) {
+        ERROR("spunnel: relay: can't watch fd %d: %s",fd,strerror(errno));
+        return -1;
+    }
+    r->stop = fd;
+    return 0;
+}
+
+void relay_note_conn(struct relay *r, struct relay_listener *l, int delta)
+{
+    l->conns += delta;
+    if (delta > 0)
+        l->accepted++;
+    clock_gettime(CLOCK_MONOTONIC,&l->last_active);
+    r->last_active = l->last_active;
+}
+
+void relay_note_bytes(struct relay *r, struct relay_listener *l, size_t n)
+{
+    l->bytes += n;
+    clock_gettime(CLOCK_MONOTONIC,&l->last_active);
+    r->last_active = l->last_active;
+}
+
+int relay_stats(struct relay *r, int lfd, struct relay_stats *st)
+{
+    struct relay_listener *l;
+    struct timespec now, last = { 0, 0 };
+    int found = 0;
+
+    memset(st,0,sizeof(*st));
+    for (l = r->listeners; l != NULL; l = l->next) {
+        if (lfd >= 0 && l->fd != lfd)
+            continue;
+        st->conns += l->conns;
+        st->accepted += l->accepted;
+        st->bytes += l->bytes;
+        if (l->last_active.tv_sec > last.tv_sec)
+            last = l->last_active;
+        found = 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    st->idle = (last.tv_sec > 0) ? now.tv_sec - last.tv_sec : -1;
+    return found ? 0 : -1;
+}
+
+int relay_idle_left(struct relay *r)
+{
+    struct timespec now;
+    long ms;
+
+    if (r->idle <= 0)
+        return -1;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    ms = r->idle * 1000L - (now.tv_sec - r->last_active.tv_sec) * 1000L -
+         (now.tv_nsec - r->last_active.tv_nsec) / 1000000;
+    return (ms > 0) ? ms : 0;
+}
+
+enum relay_backend relay_set_backend(struct relay *r, enum relay_backend want)
+{
+    r->backend = RELAY_BACKEND_EPOLL;
+    if (want == RELAY_BACKEND_URING) {
+        if (relay_uring_probe() == 0)
+            r->backend = RELAY_BACKEND_URING;
+        else
+            ERROR("spunnel: relay: io_uring is not available, using epoll");
+    }
+    return r->backend;
+}
+
+const char *relay_backend_name(enum relay_backend backend)
+{
+    switch (backend) {
+    case RELAY_BACKEND_EPOLL:
+        return "epoll";
+    case RELAY_BACKEND_URING:
+        return "io_uring";
+    default:
+        return "auto";
+    }
+}
+
+int relay_run(struct relay *r)
+{
+    if (r->backend == RELAY_BACKEND_URING)
+        return relay_uring_run(r);
+    return _epoll_run(r);
+}
+
+/*
+ * relay_run_workers: worker k > 0 runs a copy of r on a thread of its own
+ */
+struct relay_worker {
+    struct relay *r;
+    pthread_t     thread;
+    int           cpu;      // to pin it to, or -1
+};
+
+static void _pin(int cpu)
+{
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    if ((errno = pthread_setaffinity_np(pthread_self(),sizeof(set),&set)) != 0)
+        DEBUG("spunnel: relay: unable to pin to cpu %d: %s",cpu,strerror(errno));
+}
+
+static void *_worker_main(void *arg)
+{
+    struct relay_worker *w = arg;
+    sigset_t mask;
+
+    // the signals are for the thread that called relay_run_workers
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK,&mask,NULL);
+    _pin(w->cpu);
+    if (relay_run(w->r) != 0)
+        ERROR("spunnel: relay: a worker stopped");
+    return NULL;
+}
+
+/*
+ * A copy of r for another worker: the same forwardings from listeners of
+ * its own, bound to the same addresses with SO_REUSEPORT.  Unix sockets
+ * can't be shared that way and stay with r.  The copy stops with stop.
+ */
+static struct relay *_relay_copy(struct relay *r, int stop)
+{
+    struct relay *copy;
+    struct relay_listener *l;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int fd;
+
+    if ((copy = relay_create()) == NULL)
+        return NULL;
+    copy->backend = r->backend;
+    copy->splice_ok = r->splice_ok;
+    for (l = r->listeners; l != NULL; l = l->next) {
+        addrlen = sizeof(addr);
+        if (getsockname(l->fd,(struct sockaddr *)&addr,&addrlen) != 0)
+            goto fail;
+        if (addr.ss_family == AF_UNIX)
+            continue;
+        if ((fd = _listen_addr((struct sockaddr *)&addr,addrlen,1)) < 0) {
+            ERROR("spunnel: relay: unable to open another listener: %s",strerror(errno));
+            goto fail;
+        }
+        if (relay_add(copy,fd,(struct sockaddr *)&l->addr,l->addrlen) != 0) {
+            close(fd);
+            goto fail;
+        }
+    }
+    if (relay_set_stop(copy,stop) != 0)
+        goto fail;
+    return copy;
+
+    fail:
+    relay_destroy(copy);
+    return NULL;
+}
+
+int relay_run_workers(struct relay *r, int n, int pin)
+{
+    struct relay_worker *workers;
+    cpu_set_t allowed;
+    uint64_t one = 1;
+    int *cpus = NULL;
+    int i, k, ncpus = 0, started, stop, rc;
+
+    if (n <= 1)
+        return relay_run(r);
+    if ((workers = calloc(n,sizeof(*workers))) == NULL ||
+        (stop = eventfd(0,EFD_CLOEXEC)) < 0) {
+        free(workers);
+        return relay_run(r);
+    }
+
+    // worker k goes on the k-th cpu we may run on, round robin
+    if (pin && sched_getaffinity(0,sizeof(allowed),&allowed) == 0 &&
+        (cpus = calloc(CPU_SETSIZE,sizeof(int))) != NULL) {
+        for (i = 0; i < CPU_SETSIZE; i++) {
+            if (CPU_ISSET(i,&allowed))
+                cpus[ncpus++] = i;
+        }
+    }
+    for (k = 0; k < n; k++)
+        workers[k].cpu = (ncpus > 0) ? cpus[k % ncpus] : -1;
+    free(cpus);
+
+    for (started = 1; started < n; started++) {
+        workers[started].r = _relay_copy(r,stop);
+        if (workers[started].r == NULL ||
+            pthread_create(&workers[started].thread,NULL,_worker_main,&workers[started]) != 0) {
+            relay_destroy(workers[started].r);
+            ERROR("spunnel: relay: running %d of %d workers",started,n);
+            break;
+        }
+    }
+    DEBUG("spunnel: relay: %d workers",started);
+
+    _pin(workers[0].cpu);
+    rc = relay_run(r);
+
+    // whatever stopped this one stops them all
+    if (write(stop,&one,sizeof(one)) != sizeof(one))
+        ERROR("spunnel: relay: unable to stop the workers: %s",strerror(errno));
+    for (k = 1; k < started; k++) {
+        pthread_join(workers[k].thread,NULL);
+        relay_destroy(workers[k].r);
+    }
+    close(stop);
+    free(workers);
+    return rc;
+}
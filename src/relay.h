@@ -0,0 +1,142 @@
+/***************************************************************************\
+ relay.h - in-process TCP relay for spunnel's native transport
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_RELAY_H
+#define _SPUNNEL_RELAY_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+
+struct relay;
+
+/*
+ * Event loops the relay can run on.  AUTO is epoll, whose splice path never
+ * copies the data into userspace; the io_uring loop does, so it is only used
+ * when asked for.
+ */
+enum relay_backend {
+    RELAY_BACKEND_AUTO,
+    RELAY_BACKEND_EPOLL,
+    RELAY_BACKEND_URING
+};
+
+/*
+ * Creates an empty relay.  Returns NULL if the event loop could not be set up.
+ */
+struct relay *relay_create(void);
+void relay_destroy(struct relay *r);
+
+/*
+ * Chooses the event loop.  Returns the backend that will actually run,
+ * which is epoll when io_uring was asked for but is not available.
+ */
+enum relay_backend relay_set_backend(struct relay *r, enum relay_backend want);
+const char *relay_backend_name(enum relay_backend backend);
+
+/*
+ * Opens a non-blocking listening socket on the loopback address, the same
+ * place ssh -L binds by default.  Returns the fd or -1.
+ */
+int relay_listen(int port);
+
+/*
+ * Same with SO_REUSEPORT, so that relay_run_workers can open more
+ * listeners on the port for its workers
+ */
+int relay_listen_shared(int port);
+
+/*
+ * Same for a unix socket at path, replacing whatever was there
+ */
+int relay_listen_unix(const char *path);
+
+/*
+ * Resolves host:port into addr.  Returns 0 on success.
+ */
+int relay_resolve(const char *host, int port,
+                  struct sockaddr_storage *addr, socklen_t *addrlen);
+
+/*
+ * Adds a forwarding: connections accepted on lfd are relayed to addr.  The
+ * relay owns lfd from then on.
+ */
+int relay_add(struct relay *r, int lfd,
+              const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Takes the forwarding of listener lfd away again, closing lfd and every
+ * connection accepted on it.  Only while relay_run is not running.
+ */
+int relay_remove(struct relay *r, int lfd);
+
+/*
+ * Makes relay_run return once no data has moved and no connection has come
+ * or gone for seconds (counted from this call if nothing has happened
+ * yet).  Connections that are still open then, but silent, are dropped
+ * with the relay.
+ */
+void relay_set_idle(struct relay *r, int seconds);
+
+/*
+ * Makes relay_run return once fd becomes readable: a pidfd whose process
+ * has exited, or a pipe whose writers are all gone.  The relay does not
+ * own fd.
+ */
+int relay_set_stop(struct relay *r, int fd);
+
+/*
+ * What went through the connections of listener lfd, or of all listeners
+ * if lfd is -1
+ */
+struct relay_stats {
+    int      conns;         // open now
+    uint64_t accepted;
+    uint64_t bytes;         // read from either side
+    int      idle;          // seconds since the last byte or connection
+};
+
+int relay_stats(struct relay *r, int lfd, struct relay_stats *st);
+
+/*
+ * Runs the event loop.  Only returns on a fatal error (-1), or with 0 when
+ * it went idle as set by relay_set_idle or was stopped by relay_set_stop.
+ * On epoll it can be run again afterwards and carries on where it left
+ * off, with whatever relay_add and relay_remove changed in between.
+ */
+int relay_run(struct relay *r);
+
+/*
+ * relay_run on n workers, the caller's thread and n - 1 more, each with an
+ * event loop and SO_REUSEPORT listeners of its own, so that the kernel
+ * spreads the connections between them and they share nothing while they
+ * relay.  With pin each worker is pinned to one of the CPUs the process
+ * may run on.  r's TCP listeners must come from relay_listen_shared.
+ * Returns when the caller's own run does, stopping the others; so the
+ * workers stop with relay_set_stop, but relay_set_idle applies to the
+ * caller's listeners alone and is best not used with more than one.
+ */
+int relay_run_workers(struct relay *r, int n, int pin);
+
+#endif
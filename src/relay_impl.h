@@ -0,0 +1,94 @@
+/***************************************************************************\
+ relay_impl.h - spunnel relay internals shared by the relay backends
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_RELAY_IMPL_H
+#define _SPUNNEL_RELAY_IMPL_H
+
+#include <sys/socket.h>
+#include <stdint.h>
+#include <time.h>
+
+enum relay_kind {
+    RELAY_LISTENER,
+    RELAY_END,
+    RELAY_STOP
+};
+
+struct relay_listener {
+    enum relay_kind         kind;
+    int                     fd;
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+    struct relay_listener  *next;
+
+    // activity, see relay_stats
+    int                     conns;
+    uint64_t                accepted;
+    uint64_t                bytes;
+    struct timespec         last_active;
+};
+
+struct relay_conn;
+struct relay_pipe;
+
+struct relay {
+    enum relay_backend     backend;
+    struct relay_listener *listeners;
+
+    // relay_set_idle, and the last activity on any listener
+    int                    idle;
+    struct timespec        last_active;
+
+    // relay_set_stop, -1 if none
+    int                    stop;
+    enum relay_kind        stop_kind;
+
+    // epoll backend
+    int                    epfd;
+    struct relay_conn     *conns;
+    struct relay_conn     *dead;
+    struct relay_pipe     *pipes;
+    int                    npipes;
+    int                    splice_ok;
+};
+
+/*
+ * Backends count connections of listener l as they are opened and closed
+ * with relay_note_conn, and the bytes read from either side with
+ * relay_note_bytes.  relay_idle_left says how many milliseconds are left
+ * before relay_run should return for want of activity: -1 for never, 0 for
+ * now.
+ */
+void relay_note_conn(struct relay *r, struct relay_listener *l, int delta);
+void relay_note_bytes(struct relay *r, struct relay_listener *l, size_t n);
+int relay_idle_left(struct relay *r);
+
+/*
+ * io_uring backend, relay_uring.c.  relay_uring_probe returns 0 if the
+ * running kernel can run it.
+ */
+int relay_uring_probe(void);
+int relay_uring_run(struct relay *r);
+
+#endif
@@ -0,0 +1,659 @@
+/***************************************************************************\
+ relay_uring.c - io_uring backend for the spunnel relay
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+/*
+ * Same job as the epoll loop in relay.c, but completion based: every
+ * direction of every connection always has exactly one read or write
+ * queued on the ring.  All the requests produced while handling a batch of
+ * completions go to the kernel with the single io_uring_enter that also
+ * waits for the next batch, so a busy relay makes about one syscall per
+ * batch instead of several per message.
+ *
+ * Reads and writes use a slab of buffers registered with the ring
+ * (READ_FIXED/WRITE_FIXED).  Connections that find the slab used up, or
+ * rings where registration is refused (RLIMIT_MEMLOCK), use malloc'd
+ * buffers and plain READ/WRITE.
+ *
+ * The ring is driven with the raw syscalls so there is no liburing
+ * dependency.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "spunnel.h"
+#include "relay.h"
+#include "relay_impl.h"
+
+/*
+ * IORING_FEAT_FAST_POLL (5.7) also guarantees the probe interface and
+ * every opcode used below.
+ */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_FEAT_FAST_POLL) && \
+    defined(__NR_io_uring_setup)
+
+/*
+ * Ring size, and the number and size of registered buffers.  Each
+ * connection holds two buffers, one per direction.
+ */
+#define URING_ENTRIES   256
+#define URING_BUFS      256
+#define URING_BUF_SIZE  16384
+
+/*
+ * What a completion is for is kept in the low bits of its user_data, the
+ * rest is the listener or connection pointer.  user_data 0 is used for
+ * cancel requests, whose completions are ignored, URING_TIMER (a connect
+ * without a connection) for the relay_set_idle timeout and URING_STOP (I/O
+ * without a connection) for the poll on the relay_set_stop fd.
+ */
+#define URING_ACCEPT    0
+#define URING_CONNECT   1
+#define URING_IO        2       // + direction
+#define URING_OP_MASK   3UL
+#define URING_TIMER     ((uint64_t)URING_CONNECT)
+#define URING_STOP      ((uint64_t)URING_IO)
+
+struct uring {
+    int                  fd;
+    unsigned            *sq_head;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_entries;
+    unsigned            *sq_array;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    size_t               sq_ring_sz;
+    void                *cq_ring;
+    size_t               cq_ring_sz;
+    size_t               sqes_sz;
+    unsigned             queued;    // SQEs not yet handed to the kernel
+    struct relay        *r;
+    struct uring_conn   *conns;
+    struct __kernel_timespec timeout;
+    int                  timer;     // an idle timeout is queued
+    int                  stopped;   // the stop fd became readable
+
+    char                *slab;      // registered buffers, NULL if none
+    int                  free_bufs[URING_BUFS];
+    int                  nfree;
+};
+
+/*
+ * Direction i moves data read from fd[i] to fd[!i] through mem[i].  len[i]
+ * is 0 while a read is queued and the unwritten byte count while a write is.
+ */
+struct uring_conn {
+    struct relay_listener *l;
+    int                    fd[2];
+    char                  *mem[2];
+    int                    buf[2];   // registered buffer index, -1 if malloc'd
+    size_t                 off[2];
+    size_t                 len[2];
+    int                    eof[2];
+    int                    inflight;
+    int                    connected;
+    int                    closing;
+    struct uring_conn     *prev;
+    struct uring_conn     *next;
+};
+
+
+static int _enter(struct uring *u, unsigned submit, unsigned wait)
+{
+    int rc;
+
+    rc = syscall(__NR_io_uring_enter,u->fd,submit,wait,
+                 wait ? IORING_ENTER_GETEVENTS : 0,NULL,0);
+    if (rc > 0)
+        u->queued -= rc;
+    return rc;
+}
+
+static int _setup(struct uring *u)
+{
+    struct io_uring_params p;
+    struct iovec iov[URING_BUFS];
+    char *sq, *cq;
+    int i;
+
+    memset(u,0,sizeof(*u));
+    memset(&p,0,sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup,URING_ENTRIES,&p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_sz > u->sq_ring_sz)
+            u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+    u->sq_ring = mmap(NULL,u->sq_ring_sz,PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE,u->fd,IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        u->cq_ring = u->sq_ring;
+    else {
+        u->cq_ring = mmap(NULL,u->cq_ring_sz,PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,u->fd,IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL,u->sqes_sz,PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE,u->fd,IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+    u->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_entries = (unsigned *)(sq + p.sq_off.ring_entries);
+    u->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // registered buffers are an optimisation, carry on without them
+    u->slab = mmap(NULL,(size_t)URING_BUFS * URING_BUF_SIZE,
+                   PROT_READ | PROT_WRITE,MAP_PRIVATE | MAP_ANONYMOUS,-1,0);
+    if (u->slab != MAP_FAILED) {
+        for (i = 0; i < URING_BUFS; i++) {
+            iov[i].iov_base = u->slab + (size_t)i * URING_BUF_SIZE;
+            iov[i].iov_len = URING_BUF_SIZE;
+            u->free_bufs[i] = URING_BUFS - 1 - i;
+        }
+        if (syscall(__NR_io_uring_register,u->fd,IORING_REGISTER_BUFFERS,
+                    iov,URING_BUFS) == 0)
+            u->nfree = URING_BUFS;
+        else {
+            DEBUG("spunnel: relay: unable to register io_uring buffers: %s",
+                  strerror(errno));
+            munmap(u->slab,(size_t)URING_BUFS * URING_BUF_SIZE);
+            u->slab = NULL;
+        }
+    }
+    else
+        u->slab = NULL;
+    return 0;
+
+    fail:
+    ERROR("spunnel: relay: unable to map io_uring: %s",strerror(errno));
+    if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring,u->sq_ring_sz);
+    if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring,u->cq_ring_sz);
+    close(u->fd);
+    return -1;
+}
+
+/*
+ * Returns a zeroed submission entry, flushing the queue to the kernel
+ * first if it is full.
+ */
+static struct io_uring_sqe *_sqe_get(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head, tail, idx;
+
+    for (;;) {
+        head = __atomic_load_n(u->sq_head,__ATOMIC_ACQUIRE);
+        tail = *u->sq_tail;
+        if (tail - head < *u->sq_entries)
+            break;
+        if (_enter(u,u->queued,0) < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY)
+            return NULL;
+    }
+    idx = tail & *u->sq_mask;
+    sqe = &u->sqes[idx];
+    memset(sqe,0,sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail,tail + 1,__ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+static int _queue(struct uring *u, int opcode, int fd, const void *addr,
+                  unsigned len, uint64_t off, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = _sqe_get(u);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+/*
+ * The ring only waits for a listener to be readable and the connections are
+ * accepted here: the listeners are nonblocking, and have to stay so since
+ * the caller may share them with dup() (an IORING_OP_ACCEPT would give up
+ * on them with -EAGAIN right away)
+ */
+static int _queue_accept(struct uring *u, struct relay_listener *l)
+{
+    struct io_uring_sqe *sqe = _sqe_get(u);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = l->fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = (uintptr_t)l | URING_ACCEPT;
+    return 0;
+}
+
+static int _queue_stop(struct uring *u, int fd)
+{
+    struct io_uring_sqe *sqe = _sqe_get(u);
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll_events = POLLIN;
+    sqe->user_data = URING_STOP;
+    return 0;
+}
+
+/*
+ * Queues the next operation for direction i: a read while nothing is
+ * buffered, a write of what is left otherwise.
+ */
+static int _queue_io(struct uring *u, struct uring_conn *c, int i)
+{
+    struct io_uring_sqe *sqe = _sqe_get(u);
+    int fixed = c->buf[i] >= 0;
+
+    if (sqe == NULL)
+        return -1;
+    if (c->len[i] == 0) {
+        sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->fd = c->fd[i];
+        sqe->addr = (uintptr_t)c->mem[i];
+        sqe->len = URING_BUF_SIZE;
+    }
+    else {
+        sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = c->fd[!i];
+        sqe->addr = (uintptr_t)(c->mem[i] + c->off[i]);
+        sqe->len = c->len[i];
+    }
+    if (fixed)
+        sqe->buf_index = c->buf[i];
+    sqe->user_data = (uintptr_t)c | (URING_IO + i);
+    c->inflight++;
+    return 0;
+}
+
+static void _conn_free(struct uring *u, struct uring_conn *c)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (c->fd[i] >= 0)
+            close(c->fd[i]);
+        if (c->buf[i] >= 0)
+            u->free_bufs[u->nfree++] = c->buf[i];
+        else
+            free(c->mem[i]);
+    }
+    if (c->prev != NULL)
+        c->prev->next = c->next;
+    else
+        u->conns = c->next;
+    if (c->next != NULL)
+        c->next->prev = c->prev;
+    free(c);
+}
+
+/*
+ * Tears a connection down.  Queued operations are kicked out with a
+ * shutdown, or cancelled while the connect is still pending, and the
+ * connection is freed once the last of them has completed.
+ */
+static void _conn_close(struct uring *u, struct uring_conn *c)
+{
+    if (!c->closing) {
+        c->closing = 1;
+        relay_note_conn(u->r,c->l,-1);
+        if (!c->connected)
+            _queue(u,IORING_OP_ASYNC_CANCEL,-1,
+                   (void *)((uintptr_t)c | URING_CONNECT),0,0,0);
+        shutdown(c->fd[0],SHUT_RDWR);
+        shutdown(c->fd[1],SHUT_RDWR);
+    }
+    if (c->inflight == 0)
+        _conn_free(u,c);
+}
+
+static void _conn_new(struct uring *u, struct relay_listener *l, int fd)
+{
+    struct uring_conn *c;
+    int one = 1;
+    int i;
+
+    if ((c = calloc(1,sizeof(struct uring_conn))) == NULL) {
+        close(fd);
+        return;
+    }
+    c->l = l;
+    c->next = u->conns;
+    if (u->conns != NULL)
+        u->conns->prev = c;
+    u->conns = c;
+    c->fd[0] = fd;
+    c->fd[1] = socket(l->addr.ss_family,SOCK_STREAM | SOCK_CLOEXEC,0);
+    for (i = 0; i < 2; i++) {
+        if (u->nfree > 0) {
+            c->buf[i] = u->free_bufs[--u->nfree];
+            c->mem[i] = u->slab + (size_t)c->buf[i] * URING_BUF_SIZE;
+        }
+        else {
+            c->buf[i] = -1;
+            c->mem[i] = malloc(URING_BUF_SIZE);
+        }
+    }
+    if (c->fd[1] < 0 || c->mem[0] == NULL || c->mem[1] == NULL) {
+        _conn_free(u,c);
+        return;
+    }
+    setsockopt(c->fd[0],IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+    setsockopt(c->fd[1],IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one));
+
+    // the connect op reads the address from the listener, which outlives it
+    if (_queue(u,IORING_OP_CONNECT,c->fd[1],&l->addr,0,l->addrlen,
+               (uintptr_t)c | URING_CONNECT) < 0) {
+        _conn_free(u,c);
+        return;
+    }
+    c->inflight++;
+    relay_note_conn(u->r,l,1);
+}
+
+/*
+ * Queues a timeout for when the relay goes idle, unless one is queued
+ * already.  Returns 1 if it is idle now.
+ */
+static int _queue_timer(struct uring *u)
+{
+    int left;
+
+    if (u->timer || (left = relay_idle_left(u->r)) < 0)
+        return 0;
+    if (left == 0)
+        return 1;
+    u->timeout.tv_sec = left / 1000;
+    u->timeout.tv_nsec = (left % 1000) * 1000000L;
+    if (_queue(u,IORING_OP_TIMEOUT,-1,&u->timeout,1,0,URING_TIMER) == 0)
+        u->timer = 1;
+    return 0;
+}
+
+static void _conn_io(struct uring *u, struct uring_conn *c, int i, int res)
+{
+    if (res < 0 || (res == 0 && c->len[i] > 0))
+        goto broken;
+
+    if (c->len[i] == 0) {
+        // a read finished
+        if (res == 0) {
+            c->eof[i] = 1;
+            shutdown(c->fd[!i],SHUT_WR);
+            if (c->eof[!i] && c->len[!i] == 0)
+                goto broken;
+            return;
+        }
+        c->off[i] = 0;
+        c->len[i] = res;
+        relay_note_bytes(u->r,c->l,res);
+    }
+    else {
+        // a write finished, possibly short
+        c->off[i] += res;
+        c->len[i] -= res;
+    }
+    if (_queue_io(u,c,i) == 0)
+        return;
+
+    broken:
+    _conn_close(u,c);
+}
+
+static int _complete(struct uring *u, uint64_t user_data, int res)
+{
+    unsigned op = user_data & URING_OP_MASK;
+    struct relay_listener *l;
+    struct uring_conn *c;
+    int fd;
+
+    if (user_data == 0)
+        return 0;
+    if (user_data == URING_TIMER) {
+        u->timer = 0;
+        return 0;
+    }
+    if (user_data == URING_STOP) {
+        u->stopped = 1;
+        return 0;
+    }
+
+    if (op == URING_ACCEPT) {
+        l = (struct relay_listener *)(uintptr_t)(user_data & ~URING_OP_MASK);
+        if (res < 0 && res != -EINTR) {
+            ERROR("spunnel: relay: poll on listener: %s",strerror(-res));
+            return -1;
+        }
+        while ((fd = accept4(l->fd,NULL,NULL,SOCK_CLOEXEC)) >= 0)
+            _conn_new(u,l,fd);
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != ECONNABORTED && errno != EMFILE && errno != ENFILE &&
+            errno != ENOBUFS && errno != ENOMEM) {
+            ERROR("spunnel: relay: accept: %s",strerror(errno));
+            return -1;
+        }
+        return _queue_accept(u,l);
+    }
+
+    c = (struct uring_conn *)(uintptr_t)(user_data & ~URING_OP_MASK);
+    c->inflight--;
+    if (c->closing) {
+        _conn_close(u,c);
+        return 0;
+    }
+    if (op == URING_CONNECT) {
+        if (res < 0) {
+            DEBUG("spunnel: relay: connect to exec host failed: %s",strerror(-res));
+            _conn_close(u,c);
+            return 0;
+        }
+        c->connected = 1;
+        if (_queue_io(u,c,0) < 0 || _queue_io(u,c,1) < 0)
+            _conn_close(u,c);
+        return 0;
+    }
+    _conn_io(u,c,op - URING_IO,res);
+    return 0;
+}
+
+/*
+ * Lets go of everything when relay_run returns.  The sockets are shut
+ * down first so that nothing queued still reads into a buffer, and closing
+ * the ring cancels the rest and its hold on the listeners.
+ */
+static void _teardown(struct uring *u)
+{
+    struct uring_conn *c;
+
+    for (c = u->conns; c != NULL; c = c->next) {
+        if (!c->closing)
+            relay_note_conn(u->r,c->l,-1);
+        shutdown(c->fd[0],SHUT_RDWR);
+        shutdown(c->fd[1],SHUT_RDWR);
+    }
+    close(u->fd);
+    while (u->conns != NULL)
+        _conn_free(u,u->conns);
+    if (u->slab != NULL)
+        munmap(u->slab,(size_t)URING_BUFS * URING_BUF_SIZE);
+    munmap(u->sqes,u->sqes_sz);
+    if (u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring,u->cq_ring_sz);
+    munmap(u->sq_ring,u->sq_ring_sz);
+}
+
+int relay_uring_probe(void)
+{
+    static const int needed[] = {
+        IORING_OP_CONNECT, IORING_OP_ASYNC_CANCEL,
+        IORING_OP_TIMEOUT, IORING_OP_POLL_ADD,
+        IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED
+    };
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int fd, i, rc = -1;
+
+    memset(&p,0,sizeof(p));
+    fd = syscall(__NR_io_uring_setup,4,&p);
+    if (fd < 0)
+        return -1;
+    if ((probe = calloc(1,len)) != NULL &&
+        syscall(__NR_io_uring_register,fd,IORING_REGISTER_PROBE,probe,256) == 0) {
+        rc = 0;
+        for (i = 0; i < (int)(sizeof(needed) / sizeof(needed[0])); i++) {
+            if (needed[i] > probe->last_op ||
+                !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+                rc = -1;
+        }
+    }
+    free(probe);
+    close(fd);
+    return rc;
+}
+
+int relay_uring_run(struct relay *r)
+{
+    struct relay_listener *l;
+    struct io_uring_cqe *cqe;
+    struct uring u;
+    uint64_t user_data;
+    unsigned head, tail;
+    int res, rc = -1;
+
+    if (_setup(&u) < 0) {
+        ERROR("spunnel: relay: io_uring setup failed: %s",strerror(errno));
+        return -1;
+    }
+    u.r = r;
+
+    for (l = r->listeners; l != NULL; l = l->next) {
+        if (_queue_accept(&u,l) < 0)
+            goto done;
+    }
+    if (r->stop >= 0 && _queue_stop(&u,r->stop) < 0)
+        goto done;
+
+    for (;;) {
+        if (_queue_timer(&u) || u.stopped) {
+            rc = 0;
+            goto done;
+        }
+        // hand over everything queued and wait for at least one completion
+        if (_enter(&u,u.queued,1) < 0 && errno != EINTR && errno != EAGAIN &&
+            errno != EBUSY) {
+            ERROR("spunnel: relay: io_uring_enter: %s",strerror(errno));
+            goto done;
+        }
+        head = *u.cq_head;
+        tail = __atomic_load_n(u.cq_tail,__ATOMIC_ACQUIRE);
+        while (head != tail) {
+            cqe = &u.cqes[head & *u.cq_mask];
+            user_data = cqe->user_data;
+            res = cqe->res;
+            __atomic_store_n(u.cq_head,++head,__ATOMIC_RELEASE);
+            if (_complete(&u,user_data,res) < 0)
+                goto done;
+        }
+    }
+
+    done:
+    _teardown(&u);
+    return rc;
+}
+
+#else
+
+int relay_uring_probe(void)
+{
+    return -1;
+}
+
+int relay_uring_run(struct relay *r)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
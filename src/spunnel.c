@@ -26,10 +26,19 @@
  *
 \***************************************************************************/
 /* Note: To compile: gcc -fPIC -shared -o spunnel spunnel-plug.c */
+#define _GNU_SOURCE
+
 #include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <poll.h>
 #include <pwd.h>
+#include <fcntl.h>
+#include <signal.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,23 +48,206 @@
 #include <stdint.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <errno.h>
 
 #include <slurm/slurm.h>
 #include <slurm/spank.h>
 
+#include "spunnel.h"
+#include "launch.h"
+#include "relay.h"
+#include "mux.h"
+#include "probe.h"
+#include "ports.h"
+#include "registry.h"
+#include "spunneld.h"
 
-#define SPUNNEL_ENVVAR         "SLURM_SPUNNEL"
 
-#define INFO  slurm_debug
-#define DEBUG slurm_debug
-#define ERROR slurm_error
+#define SPUNNEL_ENVVAR         "SLURM_SPUNNEL"
 
 
 static char* ssh_cmd = NULL;
 static char* args = NULL;
 
+/*
+ * transport=ssh (the default) forwards the ports with ssh -L, 
+ * transport=native relays them to the exec host directly, and
+ * transport=daemon has spunneld do that for all the sruns of the login
+ * node, registering with it on daemon=<socket> (see spunneld.h)
+ */
+#define TRANSPORT_SSH    0
+#define TRANSPORT_NATIVE 1
+#define TRANSPORT_DAEMON 2
+static int transport = TRANSPORT_SSH;
+static char *daemon_path = SPUNNELD_SOCKET;
+static int daemon_fd = -1;
+
+/*
+ * Event loop of the native relay: backend=auto (default, which is epoll),
+ * epoll or io_uring
+ */
+static enum relay_backend backend = RELAY_BACKEND_AUTO;
+
+/*
+ * forwarder=thread runs the relay that srun would otherwise fork (see
+ * _relay_nodes) as a thread of srun, which slurm_spank_exit stops through
+ * relay_stop and joins.  There is no process to start, watch or kill, and
+ * with transport=native nothing of the session outside srun at all.  The
+ * default is forwarder=process.
+ */
+static int forwarder_thread = 0;
+static pthread_t relay_thread;
+static struct relay *relay_threaded = NULL;
+static int relay_stop = -1;
+
+/*
+ * workers=<n> spreads a session's relay over n event loops, each a thread
+ * with SO_REUSEPORT listeners of its own on the submit ports so that the
+ * kernel balances the connections between them (see relay_run_workers).
+ * pin=yes pins each to a CPU.  Relays that reclaim idle nodes keep to one.
+ */
+static int relay_workers = 1;
+static int relay_pin = 0;
+
+/*
+ * All of a user's sessions to an exec host share one ssh master, which
+ * exits this many seconds after the last of them is done.  pool=<seconds>
+ * keeps it around longer, so that later sessions to the node attach their
+ * forwards to it with -O forward instead of paying a new ssh handshake.
+ */
+#define DEFAULT_POOL_IDLE 5
+static int pool_idle = DEFAULT_POOL_IDLE;
+
+/*
+ * async=yes sets the tunnels up in a supervisor child while srun goes on to
+ * launch the tasks.  The supervisor keeps the session and tears it down
+ * when srun closes the pipe to it (or dies).  How far it got is written to
+ * the status file named by $SPUNNEL_STATUS in the job's environment.
+ */
+static int async = 0;
+
+/*
+ * lazy=<seconds> leaves the ssh side of the --tunnel ports alone until a
+ * client connects to one of them.  The submit ports are listened on from
+ * the start, and the first connection to a node's ports brings up its
+ * master and forwards (see _lazy_watch).  Once the node's ports have gone
+ * that many seconds without a connection the forwards are taken away
+ * again, and the master exits pool= seconds after that.
+ */
+static int lazy_idle = 0;
+
+/*
+ * idle=<seconds> does the same for nodes that were connected up front:
+ * once their ports have moved no data for that long they are disconnected,
+ * to be connected again by the next client.  It also sets the quiet period
+ * of lazy=, which otherwise is the lazy= value itself.
+ */
+static int idle_timeout = 0;
+
+static int _idle_period (void)
+{
+    return (idle_timeout > 0) ? idle_timeout : lazy_idle;
+}
+
+/*
+ * probe=<seconds> waits up to that long for the exec ports to answer (see
+ * probe.h).  The relay does not accept connections until then, so early
+ * clients wait in the listen backlog instead of being reset; with ssh it
+ * probes through the tunnel.  Forwards ssh listens on itself (args=) are
+ * only probed in the background, which reports.
+ */
+static int probe_timeout = 0;
+static pid_t supervisor_pid = -1;
+static int supervisor_fd = -1;
+static char status_file[256];
+
+/*
+ * The process the session's background children (relays, the lazy=
+ * watcher) live and die with: srun, or the async supervisor for the ones
+ * it starts.  If it goes without slurm_spank_exit running, say srun was
+ * SIGKILLed or OOM-killed, they see owner_fd (a pidfd) become readable and
+ * take the session down themselves (see _follow_owner), rather than keep
+ * the ports, and with their connections the ssh masters, for good.
+ */
+static pid_t owner_pid = -1;
+static int owner_fd = -1;
+
+/*
+ * The port pairs given to --tunnel.  nodes is what followed the @, if
+ * anything (see _fwd_offset).  submit is 0 for auto, which picks a free
+ * port in auto_ports=<lo>-<hi> for every node the pair goes to.  exec is 0
+ * for auto as well, picked the same way on each node by _exec_ports_init.
+ */
+struct spunnel_fwd {
+    int   submit;
+    int   exec;
+    char *nodes;
+    int   fd;       // submit port reserved by srun while parsing, or -1
+};
+static struct spunnel_fwd *fwds = NULL;
+static int nfwds = 0;
+static int fwds_size = 0;
+
+#define DEFAULT_AUTO_LO 20000
+#define DEFAULT_AUTO_HI 32767
+static int auto_lo = DEFAULT_AUTO_LO;
+static int auto_hi = DEFAULT_AUTO_HI;
+static struct port_table port_table;
+
+/*
+ * Where the login node's port registry lives (see registry.h), NULL to do
+ * without one (registry=none)
+ */
+#define DEFAULT_REGISTRY "/dev/shm/spunnel-ports"
+static char *registry_path = DEFAULT_REGISTRY;
+
+/*
+ * The job's environment gets the forwards that were set up, as
+ * <submit port>:<node>:<exec port>[,...], so scripts can find auto ports
+ */
+#define TUNNELS_ENVVAR         "SPUNNEL_TUNNELS"
+
+/*
+ * What this srun has set up.  srun runs slurm_spank_local_user_init and
+ * slurm_spank_exit in the same process, so the state needed for teardown
+ * simply stays in memory.
+ */
+struct spunnel_node {
+    char *host;
+    char  controlfile[256];
+    int   connected;
+    int   hold;     // our connection to the master, keeps it from expiring
+    int   lock;     // held while we find or start the master
+};
+
+struct spunnel_port {
+    int   node;
+    char *bind;     // listen address, NULL for ssh's default (loopback)
+    int   submit;
+    char *host;     // as seen from the node, NULL for localhost
+    int   exec;
+    int   fd;       // our listener on submit, -1 if ssh binds it itself
+    char *path;     // unix socket ssh listens on for us, when fd is used
+};
+
+struct spunnel_session {
+    uint32_t             jobid;
+    uint32_t             stepid;
+    int                  nnodes;
+    struct spunnel_node *nodes;
+    int                  nports;
+    int                  ports_size;
+    struct spunnel_port *ports;
+    pid_t                relay_pid;
+    pid_t                prober_pid;
+    int                  watched;   // the nodes are _lazy_watch's
+    char                 shimdir[96];
+};
+
+static struct spunnel_session session = { 0, 0, 0, NULL, 0, 0, NULL, -1, -1, 0, "" };
+
 
 /* 
  * can be used to adapt the ssh parameters to use to 
@@ -68,21 +260,51 @@ static char* args = NULL;
 #define DEFAULT_ARGS ""
 
 /*
- * string pattern for file that stores the remote hostname needed for the ssh
- * control commands
+ * string patterns for the private directory (user, job id, step id) made
+ * with mkdtemp for the session's unix sockets that ssh forwards reserved
+ * submit ports from, and for each of the sockets (directory, submit port)
+ */
+#define SHIM_DIR_PATTERN        "/tmp/%s-%u.%u.tunnel.XXXXXX"
+#define SHIM_SOCKET_PATTERN     "%s/%d.sock"
+
+/*
+ * string patterns for the job's private directory on the exec host (user,
+ * job id), and for the unix socket in it that leads to an exec port picked
+ * there (user, job id, step id, index of the --tunnel pair), and the
+ * variable that tells the job which port that was
+ */
+#define EXEC_DIR_PATTERN        "/tmp/%s-%u-exec.tunnel"
+#define EXEC_SOCKET_PATTERN     EXEC_DIR_PATTERN "/%u-%d.sock"
+#define PORT_ENVVAR_PATTERN     "SPUNNEL_PORT_%d"
+
+/*
+ * The allocation's node list that srun numbered the nodes by, for the exec
+ * hosts to find their own number in (see _exec_node_index)
+ */
+#define NODES_ENVVAR            "SPUNNEL_NODES"
+
+/*
+ * string patterns for file used as the ssh control master file, one per
+ * user and exec host and shared by all of the user's sessions there, and
+ * for the lock taken to start it
  */
-#define HOST_FILE_PATTERN       "/tmp/%s-host.tunnel"
+#define CONTROL_FILE_PATTERN    "/tmp/%s-%s-control.tunnel"
+#define CONTROL_LOCK_PATTERN    "/tmp/%s-%s-control.lock"
+#define LOCK_WAIT_SEC           30
 
 /*
- * string pattern for file used as the ssh control master file
+ * string pattern for the file that caches an allocation's node list (user,
+ * job id) for sruns that could not get it from their environment
  */
-#define CONTROL_FILE_PATTERN    "/tmp/%s-control.tunnel"
+#define NODES_CACHE_PATTERN     "/tmp/%s-%u-nodes.tunnel"
 
 /*
- * string pattern for file used to indicate that slurm_spank_exit has
- * already been run
+ * string pattern for the status file of async=yes (user, job id, step id);
+ * it holds "pending", "ready", "failed" or, when probe= gave up waiting for
+ * the exec ports, "timeout"
  */
-#define EXIT_FLAG_PATTERN       "/tmp/%s-exitflag.tunnel"
+#define STATUS_FILE_PATTERN     "/tmp/%s-%u.%u-status.tunnel"
+#define STATUS_ENVVAR           "SPUNNEL_STATUS"
 
 /*
  * All spank plugins must define this macro for the SLURM plugin loader.
@@ -120,78 +342,318 @@ int port_available(int port)
     return result;
 }
 
-int file_exists(char *filename){
-    struct stat buf;
-    return (stat(filename,&buf) == 0);
+/*
+ * Adds a forwarding to the session's port map.  fd, if not -1, is the
+ * listening socket already bound to submit; the session owns it from then
+ * on.  Returns 0 on success.
+ */
+static int _session_add_port (int node, const char *bind, int submit, const char *host, int exec, int fd)
+{
+    struct spunnel_port *ports, *port;
+    int size;
+
+    if (session.nports == session.ports_size) {
+        size = session.ports_size ? session.ports_size * 2 : 16;
+        ports = realloc(session.ports,size * sizeof(struct spunnel_port));
+        if (ports == NULL)
+            return -1;
+        session.ports = ports;
+        session.ports_size = size;
+    }
+    port = &session.ports[session.nports];
+    port->node = node;
+    port->bind = (bind != NULL) ? strdup(bind) : NULL;
+    port->submit = submit;
+    port->host = (host != NULL) ? strdup(host) : NULL;
+    port->exec = exec;
+    port->fd = fd;
+    port->path = NULL;
+    session.nports++;
+    INFO("spunnel: forwarding %s:%d to %s:%d on %s",bind ? bind : "localhost",submit,
+         host ? host : "localhost",exec,session.nodes[node].host);
+    return 0;
 }
 
 /*
- * Writes the file that records the hostname
+ * ssh -L options in args= are forwarded like the port pairs of --tunnel,
+ * but only to the first node: they name a fixed submit port, which the
+ * masters of further nodes could not all bind.  Adds them to the session's
+ * port map for node idx and returns how many there were, or -1 if one
+ * can't be parsed.
  */
-int write_host_file(char *host)
+static int _session_add_args_ports (int idx)
 {
-    FILE* file;
-    char filename[256];
-    char *user = getenv("USER");
+    struct spunnel_argv av = { NULL, 0, 0 };
+    char *spec, *p, *f[4];
+    int i, n, count = 0;
+
+    if (spunnel_argv_push_words(&av,args) != 0)
+        return -1;
+    for (i = 0; i < av.n && count >= 0; i++) {
+        if (strncmp(av.v[i],"-L",2) != 0)
+            continue;
+        spec = (av.v[i][2] != '\0') ? av.v[i] + 2 : av.v[++i];
+
+        // [bind:]port:host:hostport
+        for (n = 0, p = spec; n < 4 && p != NULL; n++) {
+            f[n] = p;
+            if ((p = strchr(p,':')) != NULL)
+                *p++ = '\0';
+        }
+        if (spec == NULL || p != NULL || n < 3) {
+            ERROR("spunnel: can't parse -L in args=%s",args);
+            count = -1;
+        }
+        else if ((n == 3 ? _session_add_port(idx,NULL,atoi(f[0]),f[1],atoi(f[2]),-1) :
+                           _session_add_port(idx,f[0],atoi(f[1]),f[2],atoi(f[3]),-1)) != 0)
+            count = -1;
+        else
+            count++;
+    }
+    spunnel_argv_free(&av);
+    return count;
+}
 
-    // build file reference
-    if ( snprintf(filename,256,HOST_FILE_PATTERN,user) >= 256 ) {
-        fprintf(stderr,"Error: Unable to build file reference\n");
-        return 20;
+/*
+ * Pushes args=, without its -L options (which are in the port map), then
+ * -L [bind:]<submit>:<host>:<exec> for every port of session node idx.
+ */
+static int _session_push_args (struct spunnel_argv *av, int idx)
+{
+    struct spunnel_argv words = { NULL, 0, 0 };
+    struct spunnel_port *port;
+    char spec[1024];
+    int i, status = 0;
+
+    if (spunnel_argv_push_words(&words,args) != 0)
+        return -1;
+    for (i = 0; i < words.n && status == 0; i++) {
+        if (strncmp(words.v[i],"-L",2) == 0) {
+            if (words.v[i][2] == '\0')
+                i++;
+            continue;
+        }
+        status = spunnel_argv_push(av,words.v[i]);
+    }
+    spunnel_argv_free(&words);
+
+    for (i = 0; i < session.nports && status == 0; i++) {
+        port = &session.ports[i];
+        if (port->node != idx)
+            continue;
+        if (port->path != NULL && port->exec == MUX_PORT_UNIX)
+            snprintf(spec,sizeof(spec),"%s:%s",port->path,port->host);
+        else if (port->path != NULL)
+            snprintf(spec,sizeof(spec),"%s:%s:%d",port->path,
+                     port->host ? port->host : "localhost",port->exec);
+        else
+            snprintf(spec,sizeof(spec),"%s%s%d:%s:%d",port->bind ? port->bind : "",port->bind ? ":" : "",
+                     port->submit,port->host ? port->host : "localhost",port->exec);
+        if ( spunnel_argv_push(av,"-L") != 0 ||
+             spunnel_argv_push(av,spec) != 0 )
+            status = -1;
     }
+    return status;
+}
+
+static void _session_free (void)
+{
+    int i;
 
-    // this file shouldn't exist, so warn
-    if (file_exists(filename)){
-        fprintf(stderr,"Warning: The hostname file %s exists and will be overwritten.  There may stray ssh processes that should be killed.\n", filename);
+    for (i = 0; i < session.nnodes; i++) {
+        free(session.nodes[i].host);
+        if (session.nodes[i].hold >= 0)
+            close(session.nodes[i].hold);
+        if (session.nodes[i].lock >= 0)
+            close(session.nodes[i].lock);
+    }
+    for (i = 0; i < session.nports; i++) {
+        free(session.ports[i].bind);
+        free(session.ports[i].host);
+        if (session.ports[i].fd >= 0)
+            close(session.ports[i].fd);
+        if (session.ports[i].path != NULL) {
+            unlink(session.ports[i].path);
+            free(session.ports[i].path);
+        }
     }
+    if (session.shimdir[0] != '\0')
+        rmdir(session.shimdir);
+    session.shimdir[0] = '\0';
+    free(session.nodes);
+    free(session.ports);
+    session.nodes = NULL;
+    session.ports = NULL;
+    session.nnodes = session.nports = session.ports_size = 0;
+    session.relay_pid = -1;
+    session.prober_pid = -1;
+    session.watched = 0;
+}
 
-    // write it into reference file
-    file = fopen(filename,"w");
-    if ( file == NULL ) {
-        fprintf(stderr,"error: unable to create file %s\n", filename);
-        return 30;
+/*
+ * Parses one element of a node selection, "3" or "2-5".  Returns 0 on
+ * success.
+ */
+static int _parse_node_range (const char *str, int *lo, int *hi)
+{
+    char *end;
+
+    *lo = *hi = strtol(str,&end,10);
+    if (end == str || *lo < 0)
+        return -1;
+    if (*end == '-') {
+        str = end + 1;
+        *hi = strtol(str,&end,10);
+        if (end == str || *hi < *lo)
+            return -1;
     }
+    return (*end == '\0') ? 0 : -1;
+}
 
-    fprintf(file,"%s\n",host);
-    fclose(file);
-    return 0;
+/*
+ * Checks the node selection that follows @ in a port pair.  Returns how many
+ * nodes it names (0 for "all", which depends on the allocation) or -1 if it
+ * can't be parsed.
+ */
+static int _check_nodes (const char *nodes)
+{
+    char *sel, *tok, *ptr;
+    int count = 0, lo, hi;
+
+    if (strcmp(nodes,"all") == 0)
+        return 0;
+    sel = strdup(nodes);
+    for (tok = strtok_r(sel,"+",&ptr); tok != NULL; tok = strtok_r(NULL,"+",&ptr)) {
+        if (_parse_node_range(tok,&lo,&hi) != 0) {
+            free(sel);
+            return -1;
+        }
+        count += hi - lo + 1;
+    }
+    free(sel);
+    return count > 0 ? count : -1;
 }
 
 /*
- * Reads the host file so that the ssh tunnel can be terminated.  Deletes the
- * host file when it's done reading.
+ * Where a port pair goes on a multi-node allocation.  Without @ only the
+ * first node gets it.  "@all" sends it to every node and "@0+2-3" to the
+ * listed node indices (in allocation order).  The k-th selected node is
+ * reached on submit port + k.
+ *
+ * Returns the offset to add to the submit port for node number idx, or -1
+ * if the pair does not go to that node.
  */
-int read_host_file(char *buf)
+static int _fwd_offset (struct spunnel_fwd *fwd, int idx)
 {
-    FILE* file;
-    char filename[256];
-    char *user = getenv("USER");
- 
-    // build file reference
-    if ( snprintf(filename,256,HOST_FILE_PATTERN,user) >= 256 ) {
-        fprintf(stderr,"tunnel: unable to build file reference\n");
-        return 20;
-    }
-    file = fopen(filename,"r");
-    if ( file == NULL ) {
-        // fprintf(stderr,"tunnel: unable to read file %s. You may need to manually kill ssh tunnel processes.\n", filename);
-        return 30;
-    }
-   
-    //Read the lines of the host file 
-    char line[100]; 
-    if (fgets(line,100,file) == NULL) {
-        fprintf(stderr,"Unable to read from file %s\n",filename);
-    }
-    if (line[strlen(line) - 1] == '\n') {
-        line[strlen(line) - 1] = '\0';
-    }
-    snprintf(buf,100,"%s",line);
-    fclose(file);
-    unlink(filename);
-    return 0;
+    char *sel, *tok, *ptr;
+    int offset = 0, lo, hi;
+
+    if (fwd->nodes == NULL)
+        return (idx == 0) ? 0 : -1;
+    if (strcmp(fwd->nodes,"all") == 0)
+        return idx;
+
+    sel = strdup(fwd->nodes);
+    for (tok = strtok_r(sel,"+",&ptr); tok != NULL; tok = strtok_r(NULL,"+",&ptr)) {
+        if (_parse_node_range(tok,&lo,&hi) != 0)
+            break;
+        if (idx >= lo && idx <= hi) {
+            free(sel);
+            return offset + idx - lo;
+        }
+        offset += hi - lo + 1;
+    }
+    free(sel);
+    return -1;
+}
+
+/*
+ * Appends an entry to fwds, growing it by doubling.  Returns NULL when out
+ * of memory.
+ */
+static struct spunnel_fwd *_fwd_new (void)
+{
+    struct spunnel_fwd *f;
+    int size;
+
+    if (nfwds == fwds_size) {
+        size = fwds_size ? fwds_size * 2 : 16;
+        if ((f = realloc(fwds,size * sizeof(*f))) == NULL)
+            return NULL;
+        fwds = f;
+        fwds_size = size;
+    }
+    return &fwds[nfwds++];
+}
+
+/*
+ * Reserves port for this srun: claims it in the registry, so that the other
+ * sessions on the login node leave it alone, and keeps a socket listening
+ * on it.  Returns the socket, or -1 (saying why unless quiet).
+ */
+static int _reserve_port (int port, int quiet)
+{
+    struct registry_owner who;
+    int fd;
+
+    if (registry_path != NULL && registry_open(registry_path) != 0)
+        registry_path = NULL;
+    if (registry_claim(port,&who) != 0) {
+        if (!quiet)
+            fprintf(stderr,"port %d is held by job %u of uid %u\n",port,who.jobid,who.uid);
+        return -1;
+    }
+    fd = (relay_workers > 1) ? relay_listen_shared(port) : relay_listen(port);
+    if (fd < 0) {
+        registry_release(port);
+        if (!quiet)
+            fprintf(stderr,"port %d is in use or unavailable\n",port);
+    }
+    return fd;
 }
 
+/*
+ * Submit port of fwd on node number idx, 0 if it does not go there, or -1
+ * (saying why) if no port can be had for it.  The port is reserved by
+ * keeping a socket listening on it, returned in fd, so nobody can take it
+ * before the tunnel is up.  The port given on the command line was reserved
+ * when the option was parsed; ports shifted away from it are reserved here.
+ * Auto ports come from one scan of the kernel's socket table.
+ */
+static int _fwd_submit_port (struct spunnel_fwd *fwd, int idx, int *fd)
+{
+    int offset = _fwd_offset(fwd,idx);
+    int port = fwd->submit + offset;
+    const char *host = session.nodes[idx].host;
+
+    *fd = -1;
+    if (offset < 0)
+        return 0;
+    if (fwd->submit == 0) {
+        if (!port_table.scanned && port_table_scan(&port_table) != 0) {
+            fprintf(stderr,"unable to read the socket table to pick a port\n");
+            return -1;
+        }
+        // the table can be stale by the time we bind, and it does not
+        // know what other sruns are about to bind, so try a few
+        while ((port = port_table_pick(&port_table,auto_lo,auto_hi)) >= 0) {
+            if ((*fd = _reserve_port(port,1)) >= 0)
+                return port;
+        }
+        fprintf(stderr,"no free port between %d and %d for node %s\n",auto_lo,auto_hi,host);
+        return -1;
+    }
+    if (offset == 0 && fwd->fd >= 0) {
+        *fd = fwd->fd;
+        fwd->fd = -1;
+        return port;
+    }
+    if (port > 65535 || (*fd = _reserve_port(port,0)) < 0) {
+        fprintf(stderr,"unable to forward port %d for node %s\n",port,host);
+        return -1;
+    }
+    return port;
+}
 
 /*
  *  Provide a --tunnel option to srun:
@@ -200,7 +662,7 @@ static int _tunnel_opt_process (int val, const char *optarg, int remote);
 
 struct spank_option spank_opts[] =
 {
-        { "tunnel", "<submit port:exec port[,submit port:exec port,...]>",
+        { "tunnel", "<submit port|auto:exec port[@nodes][,submit port|auto:exec port[@nodes],...]>",
                 "Forward exec host port to submit host port via ssh -L", 1, 0,
                 (spank_opt_cb_f) _tunnel_opt_process
         },
@@ -224,286 +686,1720 @@ int slurm_spank_init (spank_t sp, int ac, char *av[])
 }
 
 /*
- * This does the actual port forward.  An ssh control master file is used
- * when the connection is established so that it can be terminated later.
+ * Adds this session's forwards for node idx to its running master, or takes
+ * them away again at the end, by talking to the master over node->hold.
+ * Returns 0 if all of them were; if one can't be added the ones before it
+ * are taken away again.
  */
-int _connect_node (char* node)
+static int _master_forwards (int idx, int add)
 {
-    int status = -1;
-
-    char* expc_cmd;
-    size_t expc_length;
-
-   
-    // Setup the control file name
-    char controlfile[1024]; 
-    char *user = getenv("USER");
-    if (snprintf(controlfile,1024,CONTROL_FILE_PATTERN,user) > 1024){
-        fprintf(stderr,"Unable to construct control file name; too big\n");
-        exit(1);
-    }
-
-    // If this control file already exists on this submit host, bail out
-    if (file_exists(controlfile)) {
-        fprintf(stderr,"ssh control file %s already exists.  Either you already have a tunnel in place, or one did not terminate correctly.  Please remove this file.\n", controlfile);
-        exit(1);
-    }
-
-
-    // sshcmd is already set
-    expc_length = strlen(node) + strlen(ssh_cmd)  + strlen(args) + strlen(controlfile) + 20;
-    expc_cmd = (char*) malloc(expc_length*sizeof(char));
-    if ( expc_cmd != NULL ) {
-        snprintf(expc_cmd,expc_length,"%s %s %s -f -N -M -S %s",ssh_cmd,node,args,controlfile);
-        status = system(expc_cmd);
-        if ( status == -1 )
-              ERROR("tunnel: unable to connect node %s with command %s",node,expc_cmd);
-        else {
-              // Write the hostname to a file
-              write_host_file(node);
+    struct spunnel_node *node = &session.nodes[idx];
+    struct spunnel_port *port;
+    int i, status = 0;
+
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        if (port->node != idx)
+            continue;
+        if ((add ? mux_forward : mux_cancel)(node->hold,port->path ? port->path : port->bind,
+                                             port->path ? MUX_PORT_UNIX : port->submit,
+                                             port->host ? port->host : "localhost",port->exec) != 0) {
+            ERROR("tunnel: unable to %s port %d on the ssh master of %s",
+                  add ? "forward" : "cancel",port->submit,node->host);
+            status = -1;
+            if (add)
+                break;
         }
-        free(expc_cmd);
     }
-    if (args != NULL){
-        free(args);
+    while (add && status != 0 && --i >= 0) {
+        port = &session.ports[i];
+        if (port->node == idx)
+            mux_cancel(node->hold,port->path ? port->path : port->bind,
+                       port->path ? MUX_PORT_UNIX : port->submit,
+                       port->host ? port->host : "localhost",port->exec);
     }
-
     return status;
 }
 
 /*
- * Takes the first of the allocated nodes and passes to _connect_node
+ * Connects to the ssh master of node through its control socket.  Anyone
+ * can create a file of that name in /tmp, and whoever answers on it would
+ * be handed the session's forwards, so the socket must be ours, writable by
+ * nobody else, and so must be the process listening on it.
  *
+ * Returns the fd, -1 if no master answers there and -2 if the file is
+ * somebody else's, which also keeps us from starting a master there.
  */
-int _spunnel_connect_nodes (char* nodes)
+static int _master_connect (struct spunnel_node *node)
 {
-
-    char* host;
-    hostlist_t hlist;
-
-    // Connect to the first host in the list
-    hlist = slurm_hostlist_create(nodes);
-    host = slurm_hostlist_shift(hlist);
-    _connect_node(host);
-    slurm_hostlist_destroy(hlist);
-
-    return 0;
+    struct stat st;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd;
+
+    if (lstat(node->controlfile,&st) != 0)
+        return -1;
+    if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 022) != 0) {
+        ERROR("spunnel: %s is not an ssh control socket of ours",node->controlfile);
+        return -2;
+    }
+    if ((fd = mux_connect(node->controlfile)) < 0)
+        return -1;
+    if (getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&len) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (cred.uid != getuid()) {
+        ERROR("spunnel: %s is served by uid %d, not us",node->controlfile,(int)cred.uid);
+        close(fd);
+        return -2;
+    }
+    return fd;
 }
+
 /*
- * This calls the functions that actually generate the ssh tunnel (_spunnel_connect_nodes, _connect_node)
- *
+ * Takes the lock for starting the master of node, which is kept next to
+ * the control socket.  It is only used if it is ours, and is waited for no
+ * longer than probe= (or LOCK_WAIT_SEC) in case whoever holds it is stuck;
+ * without it ssh is started anyway.
  */
-int slurm_spank_local_user_init (spank_t sp, int ac, char **av)
+static void _lock_master (struct spunnel_node *node)
 {
+    char lockfile[1024];
+    char *user = getenv("USER");
+    struct stat st;
+    int tries;
 
-    // nothing to do in remote mode
-    if (spank_remote (sp))
-        return 0;
-
-    // If there are no ssh args, then there is nothing to do
-    if (args == NULL){
-        goto exit;
+    if (snprintf(lockfile,sizeof(lockfile),CONTROL_LOCK_PATTERN,user,node->host) >= sizeof(lockfile) ||
+        (node->lock = open(lockfile,O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC,0600)) < 0) {
+        INFO("spunnel: unable to lock %s, starting ssh anyway",lockfile);
+        return;
     }
-    if (strstr(args,"-L") == NULL){
-        goto exit;
+    if (fstat(node->lock,&st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid()) {
+        ERROR("spunnel: %s is not ours, starting ssh without it",lockfile);
+        close(node->lock);
+        node->lock = -1;
+        return;
     }
-
-    int status = 0;
-
-    uint32_t jobid;
-    job_info_msg_t * job_buffer_ptr;
-    job_info_t* job_ptr;
-
-    // get job id
-    if ( spank_get_item (sp, S_JOB_ID, &jobid)
-         != ESPANK_SUCCESS ) {
-        status = -1;
-        goto exit;
+    tries = ((probe_timeout > 0) ? probe_timeout : LOCK_WAIT_SEC) * 10;
+    while (flock(node->lock,LOCK_EX | LOCK_NB) != 0) {
+        if ((errno != EWOULDBLOCK && errno != EINTR) || tries-- <= 0) {
+            INFO("spunnel: unable to lock %s, starting ssh anyway",lockfile);
+            close(node->lock);
+            node->lock = -1;
+            return;
+        }
+        usleep(100000);
     }
+}
 
-    // get job infos
-    status = slurm_load_job(&job_buffer_ptr,jobid,SHOW_ALL);
-    if ( status != 0 ) {
-        ERROR("spunnel: unable to get job infos");
-        status = -3;
-        goto exit;
-    }
+/*
+ * Finds the master of session node idx, taking the node's lock first so
+ * that two sessions never both start one.  If it is running our forwards
+ * are added to it right away.
+ *
+ * Returns 1 if that was done, 0 if a new master is needed (the lock is then
+ * kept until it is up) and -1 on error.
+ */
+static int _attach_master (int idx)
+{
+    struct spunnel_node *node = &session.nodes[idx];
+    pid_t pid;
 
-    // check infos validity
-    if ( job_buffer_ptr->record_count != 1 ) {
-        ERROR("spunnel: job infos are invalid");
-        status = -4;
-        goto clean_exit;
+    _lock_master(node);
+    if ((node->hold = _master_connect(node)) == -2) {
+        node->hold = -1;
+        return -1;
     }
-    job_ptr = job_buffer_ptr->job_array;
-
-    // check allocated nodes var
-    if ( job_ptr->nodes == NULL ) {
-        ERROR("spunnel: job has no allocated nodes defined");
-        status = -5;
-        goto clean_exit;
+    if (node->hold < 0 || mux_check(node->hold,&pid) != 0) {
+        // nobody is listening there, so whatever is there is stale
+        if (node->hold >= 0)
+            close(node->hold);
+        node->hold = -1;
+        unlink(node->controlfile);
+        return 0;
+    }
+    if (node->lock >= 0) {
+        close(node->lock);
+        node->lock = -1;
     }
 
-    // connect required nodes
-    status = _spunnel_connect_nodes(job_ptr->nodes);
-
-    clean_exit:
-    slurm_free_job_info_msg(job_buffer_ptr);
-
-    exit:
-    return status;
+    DEBUG("spunnel: attaching to the ssh master of %s (pid %d)",node->host,(int)pid);
+    if (_master_forwards(idx,1) != 0)
+        return -1;
+    node->connected = 1;
+    return 1;
 }
 
 /*
- * Because this is called multiple times, an exit flag file is set.  If it exists
- * (ie the second time around), the ssh tunnel is actually terminated.
- *
- * The termination command is:
+ * This does the actual port forward for session node number idx.  The
+ * forwards go to the user's ssh master for the node, through its control
+ * master file, and the master is started if there is none:
  *
- *       ssh <hostname> -S <controlfile> -O exit >/dev/null 2>&1
+ *       <ssh_cmd> <hostname> <args> -L ... -f -N -M -S <controlfile> -o ControlPersist=<pool>
+ *               -o ExitOnForwardFailure=yes -o StreamLocalBindUnlink=yes
  *
- * The hostname needed for the termination command is obtained from the hostfile.
- *
- * The controlfile is, as established above, based on the username.
+ * The first makes ssh fail rather than go on without a forward it could not
+ * bind, which would leave the session's relay connecting to nothing, or to
+ * whatever took the socket's place.  The second has it replace a unix
+ * socket left over from an earlier forward to the same path, as lazy= and
+ * idle= make when they connect a node again.
  *
+ * ssh is only started here; the caller waits for child, if it was used.
+ * Returns 0 on success, 1 if no port pair goes to this node and -1 on error.
  */
-int slurm_spank_exit (spank_t sp, int ac, char **av){
-    char* expc_cmd;
-    char* expc_pattern = "ssh %s -S %s -O exit >/dev/null 2>&1";
-    size_t expc_length;
-
+int _connect_node (int idx, struct spunnel_child *child)
+{
+    struct spunnel_node *node = &session.nodes[idx];
     int status = -1;
+    int i, count = 0, rc;
+    char persist[64];
 
-    // Read the host file so the ssh command has a host
-    char host[1000];
-    read_host_file(host);
-    if (strcmp(host, "") == 0){
-        //fprintf(stderr,"empty host file\n");
-        return 0;
-    }
-    
-    char *user = getenv("USER");
-    char controlfile[1024];
-    if (snprintf(controlfile,1024,CONTROL_FILE_PATTERN,user) > 1024){
-        fprintf(stderr,"Can't construct control file name; it's too big.");
-    }
+    struct spunnel_argv av = { NULL, 0, 0 };
 
-    // If the control file isn't there, don't do anything
-    if (!file_exists(controlfile)){
-        //fprintf(stderr,"Control file %s does not exist\n",controlfile);
-        return 0;
+    for (i = 0; i < session.nports; i++)
+        count += (session.ports[i].node == idx);
+    if (count == 0) {
+        status = 1;
+        goto done;
     }
 
-    // remove background ssh tunnels
-    expc_length = strlen(expc_pattern) + 128 ;
-    expc_cmd = (char*) malloc(expc_length*sizeof(char));
-    if ( expc_cmd != NULL &&
-            ( snprintf(expc_cmd,expc_length,expc_pattern,host,controlfile)
-                    >= expc_length )	) {
-        ERROR("tunnel: error while creating kill cmd");
+    // Setup the control file name
+    char *user = getenv("USER");
+    if (snprintf(node->controlfile,sizeof(node->controlfile),CONTROL_FILE_PATTERN,
+                 user,node->host) >= sizeof(node->controlfile)){
+        ERROR("tunnel: unable to construct control file name; too big");
+        goto done;
     }
-    else {
-        status = system(expc_cmd);
-        if ( status == -1 ) {
-            fprintf(stderr,"tunnel: unable to exec kill cmd %s",expc_cmd);
-        }
+
+    if ((rc = _attach_master(idx)) != 0) {
+        status = (rc > 0) ? 0 : -1;
+        goto done;
     }
 
-   
-   if ( expc_cmd != NULL )
-       free(expc_cmd);
-    return 0;
+    snprintf(persist,sizeof(persist),"ControlPersist=%d",pool_idle);
+    if ( spunnel_argv_push_words(&av,ssh_cmd) == 0 &&
+         spunnel_argv_push(&av,node->host) == 0 &&
+         _session_push_args(&av,idx) == 0 &&
+         spunnel_argv_push_words(&av,"-f -N -M -S") == 0 &&
+         spunnel_argv_push(&av,node->controlfile) == 0 &&
+         spunnel_argv_push(&av,"-o") == 0 &&
+         spunnel_argv_push(&av,persist) == 0 &&
+         spunnel_argv_push_words(&av,"-o ExitOnForwardFailure=yes -o StreamLocalBindUnlink=yes") == 0 &&
+         spunnel_spawn(child,av.v) == 0 )
+        status = 0;
+
+    done:
+    if ( status < 0 )
+        ERROR("tunnel: unable to connect node %s with %s",node->host,ssh_cmd);
+    spunnel_argv_free(&av);
+    return status;
 }
 
-
 /*
- * Uses the contents of the --tunnel option to create args string consisting of
- * -L <submit host>:localhost:<exec host>.  There may be multiple -L options.
+ * Starts the ssh commands for all the nodes (or just node only, if it is
+ * not -1) before waiting for any of them, so that setting up tunnels to
+ * many nodes takes about as long as setting up one.  ssh -f only returns
+ * once it has authenticated and backgrounded.
  */
-static int _tunnel_opt_process (int val, const char *optarg, int remote)
+int _connect_nodes (int only)
 {
-    if (optarg == NULL) {
-        fprintf(stderr,"--tunnel requires an argument, e.g. 8888:8888");
-        return (0);
+    struct spunnel_child *children;
+    struct spunnel_node *node;
+    int i, rc, status = 0;
+
+    if ((children = calloc(session.nnodes,sizeof(struct spunnel_child))) == NULL)
+        return -1;
+
+    for (i = 0; i < session.nnodes; i++) {
+        children[i].pid = -1;
+        if (only >= 0 && i != only)
+            continue;
+        if (_connect_node(i,&children[i]) < 0)
+            status = -1;
     }
-    
-    char *portlist = strdup(optarg);
-    int portpaircount = 1;
-    int i = 0;
-    for (i=0; i < strlen(portlist); i++){
-        if (portlist[i] == ','){
-            portpaircount++;
+    for (i = 0; i < session.nnodes; i++) {
+        node = &session.nodes[i];
+        if (children[i].pid <= 0) {
+            if (node->lock >= 0) {
+                close(node->lock);
+                node->lock = -1;
+            }
+            continue;
+        }
+        rc = spunnel_child_wait(&children[i]);
+        if (rc != 0) {
+            ERROR("tunnel: unable to connect node %s with %s (status %d)",node->host,ssh_cmd,rc);
+            status = -1;
+        }
+        else
+            node->connected = 1;
+
+        // a master we just started
+        if (node->hold < 0 && rc == 0 &&
+            (node->hold = _master_connect(node)) < 0) {
+            node->hold = -1;
+            ERROR("tunnel: ssh master for %s may expire while in use",node->host);
+        }
+        if (node->lock >= 0) {
+            close(node->lock);
+            node->lock = -1;
         }
     }
 
-    //Break up the string by comma to get the list of port pairs
-    char **portpairs = malloc(portpaircount * sizeof(char*));
-    char *ptr;
+    free(children);
+    return status;
+}
 
-    char *token  = strtok_r(portlist,",",&ptr);
-    int numpairs = 0;
-    while (token != NULL){
-        portpairs[numpairs] = strdup(token);
-        token = strtok_r(NULL,",",&ptr);
-        numpairs++;
-    }
-    free(portlist);
+/*
+ * Sets up a background child of srun: like ssh -f it leaves the terminal's
+ * session, so ^C at the srun does not reach it, and only SIGTERM from
+ * slurm_spank_exit stops it
+ */
+static void _detach (void)
+{
+    sigset_t mask;
+
+    setsid();
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK,&mask,NULL);
+    signal(SIGPIPE,SIG_IGN);
+    signal(SIGHUP,SIG_IGN);
+    signal(SIGINT,SIG_IGN);
+    signal(SIGTERM,SIG_DFL);
+}
 
-    //Go through the port pairs and create the switch string
-    int first;
-    int second;
-    char *p;
-    if (numpairs == 0){
-        return (0);
-    }
-    if (args == NULL){
-        args = (char *)calloc(1024, sizeof(char));
+/*
+ * Points stdin and stdout, and stderr unless the plugin log should still
+ * reach srun's, at /dev/null
+ */
+static void _null_stdio (int keep_stderr)
+{
+    int fd;
+
+    if ((fd = open("/dev/null",O_RDWR)) >= 0) {
+        dup2(fd,STDIN_FILENO);
+        dup2(fd,STDOUT_FILENO);
+        if (!keep_stderr)
+            dup2(fd,STDERR_FILENO);
+        if (fd > STDERR_FILENO)
+            close(fd);
     }
-    for (i=0; i<numpairs; i++){
-        char *firststr = strtok_r(portpairs[i],":",&ptr);
-        char *secondstr = strtok_r(NULL,":",&ptr);
+}
 
-        if (secondstr == NULL){
-            fprintf(stderr,"--tunnel parameter needs two numeric ports separated by a colon\n");
-            free(portpairs);
-            exit(1);
-        }
+/*
+ * Ties a background child just forked by the session's owner to it.  A
+ * relay r is stopped through owner_fd and anything else polls it.  Without
+ * a pidfd the child gets SIGTERM through PR_SET_PDEATHSIG instead, which
+ * goes by the thread that forked it rather than the process, so it is only
+ * the fallback.
+ */
+static void _follow_owner (struct relay *r)
+{
+    if (owner_fd < 0 || (r != NULL && relay_set_stop(r,owner_fd) != 0))
+        spunnel_parent_death(SIGTERM,owner_pid);
+}
 
-        first = atoi(firststr);
-        second = atoi(secondstr);
+static void _spunnel_teardown (void);
 
-        free(portpairs[i]);
+struct relay_thread_arg {
+    struct relay        *r;
+    struct probe_target *targets;
+    int                  ntargets;
+};
 
-        if (first == 0 || second == 0){
-            fprintf(stderr,"--tunnel parameter requires two numeric ports separated by a colon\n");
-            free(portpairs);
-            exit(1);
-        }
-        if (first < 1024 || second < 1024){
-            fprintf(stderr,"--tunnel cannot be used for privileged ports (< 1024)\n");
-            free(portpairs);
-            exit(1);
-        }
+static void *_relay_thread_main (void *arg)
+{
+    struct relay_thread_arg *a = arg;
+    sigset_t mask;
+
+    // srun's signals are for its other threads, and a SIGPIPE raised by a
+    // write here stays pending on this one
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK,&mask,NULL);
+    // slurm_spank_exit does not wait for the probe to finish
+    if (a->ntargets > 0)
+        probe_wait(a->targets,a->ntargets,probe_timeout,relay_stop);
+    free(a->targets);
+    if (relay_run_workers(a->r,relay_workers,relay_pin) != 0)
+        ERROR("spunnel: relay thread stopped, the tunnels are down");
+    free(a);
+    return NULL;
+}
 
-        if (!port_available(first)){
-            fprintf(stderr,"port %d is in use or unavailable\n",first);
-            free(portpairs);
-            exit(1);
-        }
-        p = strdup(args);
-        snprintf(args,256," %s -L %d:localhost:%d ",p,first,second);
-        free(portpairs); 
-        free(p);
+/*
+ * Runs relay r in a thread of srun for forwarder=thread, taking it and
+ * targets over
+ */
+static int _relay_thread_start (struct relay *r, struct probe_target *targets, int ntargets)
+{
+    struct relay_thread_arg *a;
+
+    if ((a = calloc(1,sizeof(*a))) == NULL)
+        return -1;
+    a->r = r;
+    a->targets = targets;
+    a->ntargets = ntargets;
+    if ((relay_stop = eventfd(0,EFD_CLOEXEC)) < 0 ||
+        relay_set_stop(r,relay_stop) != 0 ||
+        (errno = pthread_create(&relay_thread,NULL,_relay_thread_main,a)) != 0) {
+        ERROR("tunnel: unable to start relay thread: %s",strerror(errno));
+        if (relay_stop >= 0)
+            close(relay_stop);
+        relay_stop = -1;
+        free(a);
+        return -1;
     }
-
-    return (0);
+    relay_threaded = r;
+    return 0;
 }
 
+static void _relay_thread_stop (void)
+{
+    uint64_t one = 1;
+
+    if (relay_threaded == NULL)
+        return;
+    if (write(relay_stop,&one,sizeof(one)) != sizeof(one)) {
+        // it is still running, on the relay and relay_stop: leave them be
+        ERROR("spunnel: unable to stop the relay thread: %s",strerror(errno));
+        relay_threaded = NULL;
+        relay_stop = -1;
+        return;
+    }
+    pthread_join(relay_thread,NULL);
+    relay_destroy(relay_threaded);
+    relay_threaded = NULL;
+    close(relay_stop);
+    relay_stop = -1;
+}
 
 /*
- * Process any options on the plugstack.conf line
+ * Names a probe target after the port it stands for.
  */
-void _spunnel_init_config(spank_t sp, int ac, char *av[])
+static void _probe_name (struct probe_target *t, struct spunnel_port *port)
+{
+    if (port->exec == MUX_PORT_UNIX)
+        snprintf(t->name,sizeof(t->name),"localhost:%d (%s:auto)",port->submit,
+                 session.nodes[port->node].host);
+    else
+        snprintf(t->name,sizeof(t->name),"localhost:%d (%s:%d)",port->submit,
+                 session.nodes[port->node].host,port->exec);
+}
+
+/*
+ * The native transport.  The submit ports were reserved when the session
+ * was set up and are handed to a child that relays every accepted
+ * connection to <node>:<exec port>.  Like ssh -f the child leaves the
+ * terminal's session; slurm_spank_exit kills it.
+ *
+ * With ssh the same child relays the reserved ports to the unix sockets
+ * ssh listens on (see _session_shim_path).  Either way, with probe= it
+ * does not accept before the exec ports answer, so early connections wait
+ * in the listen backlog instead of being reset.
+ *
+ * If only is not -1 the child relays just that node's ports, for
+ * _lazy_watch, which keeps its own copy of them, and exits once they have
+ * been idle (see _idle_period), logging what went through them.
+ * Otherwise it tears the session down if its owner dies (see owner_fd),
+ * or, with forwarder=thread, is a thread of srun instead.
+ *
+ * Returns the child's pid, 0 if there was nothing to relay or it is a
+ * thread, or -1.
+ */
+pid_t _relay_nodes (int only)
+{
+    struct relay *r;
+    struct sockaddr_storage addr;
+    struct sockaddr_un *sun = (struct sockaddr_un *)&addr;
+    socklen_t addrlen;
+    struct probe_target *targets = NULL, *t;
+    struct spunnel_port *port;
+    struct relay_stats stats;
+    pid_t pid, parent = getpid();
+    int i, fd, nlisten = 0, ntargets = 0;
+
+    for (i = 0; i < session.nports; i++)
+        nlisten += (session.ports[i].fd >= 0 && (only < 0 || session.ports[i].node == only));
+    if (nlisten == 0)
+        return 0;
+    if ((r = relay_create()) == NULL)
+        return -1;
+    if (only >= 0)
+        relay_set_idle(r,_idle_period());
+    INFO("spunnel: relaying %d port(s) with %s",nlisten,
+         relay_backend_name(relay_set_backend(r,backend)));
+
+    // one relay serves the port pairs of every node
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        if (port->fd < 0 || (only >= 0 && port->node != only))
+            continue;
+        if (port->path != NULL) {
+            memset(sun,0,sizeof(*sun));
+            sun->sun_family = AF_UNIX;
+            strncpy(sun->sun_path,port->path,sizeof(sun->sun_path) - 1);
+            addrlen = sizeof(*sun);
+        }
+        else if (relay_resolve(session.nodes[port->node].host,port->exec,&addr,&addrlen) != 0)
+            goto fail;
+        if (only >= 0) {
+            if ((fd = dup(port->fd)) < 0 ||
+                relay_add(r,fd,(struct sockaddr *)&addr,addrlen) != 0) {
+                if (fd >= 0)
+                    close(fd);
+                goto fail;
+            }
+        }
+        else if (relay_add(r,port->fd,(struct sockaddr *)&addr,addrlen) != 0)
+            goto fail;
+        else
+            port->fd = -1;
+        if (probe_timeout > 0) {
+            if (targets == NULL && (targets = calloc(nlisten,sizeof(*t))) == NULL)
+                goto fail;
+            t = &targets[ntargets++];
+            memset(t,0,sizeof(*t));
+            memcpy(&t->addr,&addr,addrlen);
+            t->addrlen = addrlen;
+            // with ssh the exec port is probed through the tunnel
+            t->tunnel = (port->path != NULL);
+            _probe_name(t,port);
+        }
+    }
+
+    if (forwarder_thread && only < 0) {
+        if (_relay_thread_start(r,targets,ntargets) != 0)
+            goto fail;
+        return 0;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        ERROR("tunnel: unable to fork relay: %s",strerror(errno));
+        goto fail;
+    }
+    if (pid == 0) {
+        _detach();
+        // a node's relay goes with the _lazy_watch that started it
+        if (only >= 0)
+            spunnel_parent_death(SIGTERM,parent);
+        else
+            _follow_owner(r);
+        // connections wait in the listen backlog until the exec ports answer
+        if (ntargets > 0)
+            probe_wait(targets,ntargets,probe_timeout,(only < 0) ? owner_fd : -1);
+        _null_stdio(only >= 0);
+        if (relay_run_workers(r,(only < 0) ? relay_workers : 1,relay_pin) != 0)
+            _exit(1);
+        if (only < 0) {
+            // the session's owner died on us
+            _spunnel_teardown();
+            _exit(0);
+        }
+        // it went idle
+        relay_stats(r,-1,&stats);
+        INFO("spunnel: no traffic to %s for %d seconds, closing its relay after "
+             "%llu connection(s) and %llu bytes",session.nodes[only].host,_idle_period(),
+             (unsigned long long)stats.accepted,(unsigned long long)stats.bytes);
+        _exit(0);
+    }
+
+    // the child has the listeners now
+    relay_destroy(r);
+    free(targets);
+    return pid;
+
+    fail:
+    relay_destroy(r);
+    free(targets);
+    return -1;
+}
+
+/*
+ * Probes the session's ssh forwards through the tunnels.  The relay waits
+ * for the ones it serves itself before it accepts anything (see
+ * _relay_nodes), so unless all is set only the forwards ssh listens on
+ * directly, those of args=, are probed here.  Those of the relay are
+ * probed on ssh's unix socket, since the submit port holds connections in
+ * its backlog until then.  Returns how many did not become ready.
+ */
+static int _probe_session (int all)
+{
+    struct probe_target *targets, *t;
+    struct spunnel_port *port;
+    struct sockaddr_un *sun;
+    int i, n = 0, pending;
+
+    if (session.nports == 0)
+        return 0;
+    if ((targets = calloc(session.nports,sizeof(*targets))) == NULL)
+        return session.nports;
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        t = &targets[n];
+        if (!session.nodes[port->node].connected || (port->path != NULL && !all))
+            continue;
+        if (port->path != NULL) {
+            sun = (struct sockaddr_un *)&t->addr;
+            sun->sun_family = AF_UNIX;
+            strncpy(sun->sun_path,port->path,sizeof(sun->sun_path) - 1);
+            t->addrlen = sizeof(*sun);
+        }
+        else if (relay_resolve(port->bind ? port->bind : "localhost",port->submit,
+                               &t->addr,&t->addrlen) != 0)
+            continue;
+        t->tunnel = 1;
+        _probe_name(t,port);
+        n++;
+    }
+    pending = (n > 0) ? probe_wait(targets,n,probe_timeout,-1) : 0;
+    free(targets);
+    return pending;
+}
+
+/*
+ * ssh can't be handed our listener, so it listens on a unix socket of the
+ * session's instead and the relay passes connections from the submit port
+ * on to it.  The sockets go in a directory of the session's that only we
+ * can get into, made on first use, so that nobody else can take their
+ * place before ssh binds them.
+ */
+static int _session_shim_path (struct spunnel_port *port)
+{
+    char path[108];
+    char *user = getenv("USER");
+
+    if (session.shimdir[0] == '\0' &&
+        (snprintf(session.shimdir,sizeof(session.shimdir),SHIM_DIR_PATTERN,user,
+                  session.jobid,session.stepid) >= sizeof(session.shimdir) ||
+         mkdtemp(session.shimdir) == NULL)) {
+        ERROR("spunnel: unable to make a directory for the forwards' sockets: %s",
+              strerror(errno));
+        session.shimdir[0] = '\0';
+        return -1;
+    }
+    if (snprintf(path,sizeof(path),SHIM_SOCKET_PATTERN,session.shimdir,
+                 port->submit) >= sizeof(path) ||
+        (port->path = strdup(path)) == NULL) {
+        ERROR("spunnel: unable to name the socket for port %d",port->submit);
+        return -1;
+    }
+    if (unlink(path) != 0 && errno != ENOENT) {
+        ERROR("spunnel: unable to remove %s: %s",path,strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Expands the allocated node list into the session and works out which
+ * ports go where, picking the auto ones.  Nothing is connected yet.
+ */
+static int _session_init (char *nodes)
+{
+    hostlist_t hlist;
+    char rpath[108], exec[16];
+    char *user = getenv("USER");
+    int i, n, port, fd;
+
+    hlist = slurm_hostlist_create(nodes);
+    session.nnodes = slurm_hostlist_count(hlist);
+    session.nodes = calloc(session.nnodes,sizeof(struct spunnel_node));
+    if (session.nodes == NULL) {
+        session.nnodes = 0;
+        slurm_hostlist_destroy(hlist);
+        return -1;
+    }
+    for (n = 0; n < session.nnodes; n++) {
+        session.nodes[n].host = slurm_hostlist_shift(hlist);
+        session.nodes[n].hold = -1;
+        session.nodes[n].lock = -1;
+    }
+    slurm_hostlist_destroy(hlist);
+
+    for (n = 0; n < session.nnodes; n++) {
+        if (transport == TRANSPORT_SSH && n == 0 && _session_add_args_ports(n) < 0)
+            return -1;
+        for (i = 0; i < nfwds; i++) {
+            // a port that cannot be had fails the whole session, as it
+            // does on the command line, rather than leave a node without it
+            if ((port = _fwd_submit_port(&fwds[i],n,&fd)) < 0)
+                return -1;
+            if (port == 0)
+                continue;
+            // an exec port picked on the node is reached through its socket
+            if (fwds[i].exec == 0)
+                snprintf(rpath,sizeof(rpath),EXEC_SOCKET_PATTERN,user,
+                         session.jobid,session.stepid,i);
+            if (_session_add_port(n,NULL,port,fwds[i].exec ? NULL : rpath,
+                                  fwds[i].exec ? fwds[i].exec : MUX_PORT_UNIX,fd) != 0) {
+                close(fd);
+                return -1;
+            }
+            if (transport == TRANSPORT_SSH &&
+                _session_shim_path(&session.ports[session.nports - 1]) != 0)
+                return -1;
+            if (fwds[i].exec != 0)
+                snprintf(exec,sizeof(exec),"%d",fwds[i].exec);
+            else
+                strcpy(exec,"auto");
+            if (fwds[i].submit == 0 || fwds[i].exec == 0)
+                fprintf(stderr,"spunnel: forwarding localhost:%d to %s:%s\n",
+                        port,session.nodes[n].host,exec);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Puts the session's forwards in the job's environment (TUNNELS_ENVVAR)
+ */
+static void _session_export (spank_t sp)
+{
+    struct spunnel_port *port;
+    char *list, *p;
+    size_t size = 1;
+    int i;
+
+    for (i = 0; i < session.nports; i++)
+        size += strlen(session.nodes[session.ports[i].node].host) + 14;
+    if ((list = p = malloc(size)) == NULL)
+        return;
+    *p = '\0';
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        if (port->exec == MUX_PORT_UNIX)
+            p += sprintf(p,"%s%d:%s:auto",i ? "," : "",port->submit,
+                         session.nodes[port->node].host);
+        else
+            p += sprintf(p,"%s%d:%s:%d",i ? "," : "",port->submit,
+                         session.nodes[port->node].host,port->exec);
+    }
+    if (session.nports > 0 && spank_setenv(sp,TUNNELS_ENVVAR,list,1) != ESPANK_SUCCESS)
+        ERROR("spunnel: unable to set %s",TUNNELS_ENVVAR);
+    free(list);
+}
+
+/*
+ * Takes node idx's forwards off its master again, for lazy=.  ssh leaves
+ * the unix sockets it listened on behind, and the next -L to them would not
+ * bind, so they are removed here.
+ */
+static void _lazy_release (int idx)
+{
+    struct spunnel_node *node = &session.nodes[idx];
+    struct spunnel_port *port;
+    int i, count = 0;
+
+    if (!node->connected)
+        return;
+    if (node->hold < 0 && (node->hold = _master_connect(node)) < 0)
+        node->hold = -1;
+    if (node->hold >= 0)
+        _master_forwards(idx,0);
+    if (node->hold >= 0)
+        close(node->hold);
+    node->hold = -1;
+    node->connected = 0;
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        if (port->node != idx)
+            continue;
+        if (port->path != NULL && unlink(port->path) != 0 && errno != ENOENT)
+            ERROR("spunnel: unable to remove %s: %s",port->path,strerror(errno));
+        count++;
+    }
+    INFO("spunnel: reclaimed %s: %d forward(s) and the connection to its ssh master, "
+         "which exits in %d seconds unless another session uses it",node->host,count,pool_idle);
+}
+
+/*
+ * Whether ssh is listening on all of node idx's unix sockets.  A master
+ * that was already running takes the forwards over the control socket and
+ * says whether it could, but it is checked all the same before the relay
+ * sends clients there, now that a node can be connected many times.
+ */
+static int _lazy_bound (int idx)
+{
+    struct spunnel_port *port;
+    struct stat st;
+    int i;
+
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        if (port->node != idx || port->path == NULL)
+            continue;
+        if (lstat(port->path,&st) != 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            ERROR("spunnel: ssh is not listening on %s for %s",port->path,
+                  session.nodes[idx].host);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Resets the connections waiting for node idx when it could not be
+ * brought up, so that they fail instead of hanging
+ */
+static void _lazy_refuse (int idx)
+{
+    int i, fd;
+
+    for (i = 0; i < session.nports; i++) {
+        if (session.ports[i].node != idx || session.ports[i].fd < 0)
+            continue;
+        while ((fd = accept4(session.ports[i].fd,NULL,NULL,SOCK_CLOEXEC)) >= 0)
+            close(fd);
+    }
+}
+
+static volatile sig_atomic_t lazy_stop = 0;
+
+static void _lazy_sigterm (int sig)
+{
+    lazy_stop = 1;
+}
+
+/*
+ * The child that lazy= and idle= run instead of a single relay.  It polls
+ * the submit ports without accepting, so a first client waits in the
+ * listen backlog while its node's master and forwards come up, then leaves
+ * the node's ports to a relay of their own (_relay_nodes) until that exits
+ * for want of activity.  Nodes that were connected before it started get
+ * their relay right away.  slurm_spank_exit stops it with SIGTERM, and it
+ * takes down what is still up; if the session's owner dies first it takes
+ * down the whole session.
+ */
+static int _lazy_watch (void)
+{
+    struct pollfd *pfds;
+    struct sigaction sa;
+    pid_t *relays, pid;
+    int *which;
+    int i, n, idx, orphaned = 0;
+
+    pfds = calloc(session.nports + 1,sizeof(struct pollfd));
+    which = calloc(session.nports,sizeof(int));
+    relays = calloc(session.nnodes,sizeof(pid_t));
+    if (pfds == NULL || which == NULL || relays == NULL)
+        return 1;
+
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = _lazy_sigterm;
+    sigaction(SIGTERM,&sa,NULL);
+
+    for (i = 0; i < session.nnodes; i++) {
+        if (session.nodes[i].connected && (relays[i] = _relay_nodes(i)) <= 0) {
+            relays[i] = 0;
+            _lazy_release(i);
+        }
+    }
+
+    while (!lazy_stop) {
+        for (i = n = 0; i < session.nports; i++) {
+            if (session.ports[i].fd < 0 || relays[session.ports[i].node] > 0)
+                continue;
+            pfds[n].fd = session.ports[i].fd;
+            pfds[n].events = POLLIN;
+            which[n++] = i;
+        }
+        pfds[n].fd = owner_fd;
+        pfds[n].events = POLLIN;
+        // wakes up now and then to notice relays that went idle
+        if (poll(pfds,n + 1,1000) < 0 && errno != EINTR)
+            break;
+        if (pfds[n].revents & POLLIN)
+            orphaned = lazy_stop = 1;
+        while ((pid = waitpid(-1,NULL,WNOHANG)) > 0) {
+            for (i = 0; i < session.nnodes; i++) {
+                if (relays[i] != pid)
+                    continue;
+                relays[i] = 0;
+                _lazy_release(i);
+            }
+        }
+        for (i = 0; i < n && !lazy_stop; i++) {
+            idx = session.ports[which[i]].node;
+            if (!(pfds[i].revents & POLLIN) || relays[idx] > 0)
+                continue;
+            INFO("spunnel: first client for %s, connecting it",session.nodes[idx].host);
+            if (_connect_nodes(idx) != 0 || !_lazy_bound(idx) ||
+                (relays[idx] = _relay_nodes(idx)) <= 0) {
+                relays[idx] = 0;
+                _lazy_release(idx);
+                _lazy_refuse(idx);
+            }
+        }
+    }
+
+    for (i = 0; i < session.nnodes; i++) {
+        if (relays[i] > 0) {
+            kill(relays[i],SIGTERM);
+            waitpid(relays[i],NULL,0);
+        }
+        _lazy_release(i);
+    }
+    if (orphaned)
+        _spunnel_teardown();
+    free(pfds);
+    free(which);
+    free(relays);
+    return 0;
+}
+
+/*
+ * transport=daemon: hands the session's submit ports to spunneld, which
+ * relays them until daemon_fd is closed.  Returns 0 if it took all of
+ * them; otherwise it has none and the ports are still ours.
+ */
+static int _daemon_register (void)
+{
+    struct sockaddr_un addr;
+    struct spunneld_req req;
+    struct spunnel_port *port;
+    struct timeval tv = { 5, 0 };
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    int32_t reply;
+    int i;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,daemon_path,sizeof(addr.sun_path) - 1);
+    if ((daemon_fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) < 0 ||
+        connect(daemon_fd,(struct sockaddr *)&addr,sizeof(addr)) != 0) {
+        ERROR("spunnel: unable to reach spunneld at %s: %s",daemon_path,strerror(errno));
+        goto fail;
+    }
+    setsockopt(daemon_fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+
+    for (i = 0; i < session.nports; i++) {
+        port = &session.ports[i];
+        if (port->fd < 0)
+            continue;
+        memset(&req,0,sizeof(req));
+        req.version = SPUNNELD_VERSION;
+        req.jobid = session.jobid;
+        req.port = port->exec;
+        snprintf(req.host,sizeof(req.host),"%s",session.nodes[port->node].host);
+
+        memset(&msg,0,sizeof(msg));
+        iov.iov_base = &req;
+        iov.iov_len = sizeof(req);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg),&port->fd,sizeof(int));
+
+        if (sendmsg(daemon_fd,&msg,MSG_NOSIGNAL) != sizeof(req) ||
+            recv(daemon_fd,&reply,sizeof(reply),MSG_WAITALL) != sizeof(reply)) {
+            ERROR("spunnel: lost spunneld: %s",strerror(errno));
+            goto fail;
+        }
+        if (reply != 0) {
+            ERROR("spunnel: spunneld refused port %d: %s",port->submit,strerror(reply));
+            goto fail;
+        }
+    }
+
+    // spunneld has its own copies
+    for (i = 0; i < session.nports; i++) {
+        if (session.ports[i].fd >= 0)
+            close(session.ports[i].fd);
+        session.ports[i].fd = -1;
+    }
+    INFO("spunnel: spunneld relays the ports");
+    return 0;
+
+    fail:
+    if (daemon_fd >= 0)
+        close(daemon_fd);
+    daemon_fd = -1;
+    return -1;
+}
+
+/*
+ * Connects the session's nodes with _connect_nodes (or _relay_nodes for the
+ * native transport)
+ *
+ */
+int _spunnel_connect_nodes (void)
+{
+    int i;
+
+    if (transport == TRANSPORT_DAEMON) {
+        if (_daemon_register() == 0)
+            return 0;
+        ERROR("spunnel: relaying the ports from srun instead of spunneld");
+    }
+
+    // the native relay connects for each client anyway, lazy= or not
+    if (transport != TRANSPORT_SSH)
+        return ((session.relay_pid = _relay_nodes(-1)) < 0) ? -1 : 0;
+
+    if (lazy_idle == 0 && _connect_nodes(-1) != 0)
+        return -1;
+
+    // the async supervisor probes in place, otherwise this must not hold
+    // up the task launch that starts what is being probed
+    if (probe_timeout > 0 && !async && lazy_idle == 0) {
+        session.prober_pid = fork();
+        if (session.prober_pid == 0) {
+            signal(SIGINT,SIG_IGN);
+            signal(SIGHUP,SIG_IGN);
+            _exit(_probe_session(0) == 0 ? 0 : 1);
+        }
+        if (session.prober_pid < 0)
+            ERROR("spunnel: unable to fork the readiness probe: %s",strerror(errno));
+    }
+
+    if (_idle_period() == 0)
+        return ((session.relay_pid = _relay_nodes(-1)) < 0) ? -1 : 0;
+
+    session.relay_pid = fork();
+    if (session.relay_pid == 0) {
+        _detach();
+        _follow_owner(NULL);
+        _null_stdio(1);
+        _exit(_lazy_watch());
+    }
+    if (session.relay_pid < 0) {
+        ERROR("spunnel: unable to fork the tunnel watcher: %s",strerror(errno));
+        return -1;
+    }
+    // it takes the forwards down itself, whenever that is, and our hold
+    // must not keep an idle master alive
+    session.watched = 1;
+    for (i = 0; i < session.nnodes; i++) {
+        if (session.nodes[i].hold >= 0)
+            close(session.nodes[i].hold);
+        session.nodes[i].hold = -1;
+    }
+    return 0;
+}
+/*
+ * Reads a node list cache written by _write_file.  The file is only
+ * trusted if it is ours and nobody else can write it.  Returns a malloc'd
+ * string or NULL.
+ */
+static char *_read_nodes_cache (const char *path)
+{
+    struct stat st;
+    char *nodes = NULL;
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(path,O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0)
+        return NULL;
+    if (fstat(fd,&st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 077) != 0 || st.st_size <= 0 || st.st_size > 1024 * 1024)
+        goto done;
+    if ((nodes = malloc(st.st_size + 1)) == NULL)
+        goto done;
+    len = read(fd,nodes,st.st_size);
+    if (len != st.st_size) {
+        free(nodes);
+        nodes = NULL;
+        goto done;
+    }
+    nodes[len] = '\0';
+
+    done:
+    close(fd);
+    return nodes;
+}
+
+/*
+ * Writes a small file that other processes read (the node list cache, the
+ * status file), replacing it atomically so that they never see half of it.
+ */
+static void _write_file (const char *path, const char *nodes)
+{
+    char tmp[1024];
+    size_t len = strlen(nodes);
+    int fd;
+
+    if (snprintf(tmp,sizeof(tmp),"%s.%d",path,(int)getpid()) >= sizeof(tmp))
+        return;
+    if ((fd = open(tmp,O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,0600)) < 0)
+        return;
+    if (write(fd,nodes,len) != (ssize_t)len || close(fd) != 0 || rename(tmp,path) != 0)
+        unlink(tmp);
+}
+
+/*
+ * Finds the nodes of job jobid.  srun already has them in its environment
+ * when it runs inside an allocation, so slurmctld is only asked (with the
+ * allocation lookup, which is much lighter than loading the job) when they
+ * are not there and no earlier srun of this allocation cached them.
+ *
+ * Returns a malloc'd hostlist string or NULL.
+ */
+static char *_spunnel_job_nodes (uint32_t jobid)
+{
+    resource_allocation_response_msg_t *alloc;
+    char *env, *nodes = NULL;
+    char path[1024];
+    char *user = getenv("USER");
+
+    // the environment may come from an enclosing allocation
+    env = getenv("SLURM_JOB_ID");
+    if (env == NULL)
+        env = getenv("SLURM_JOBID");
+    if (env != NULL && strtoul(env,NULL,10) == jobid) {
+        if ((env = getenv("SLURM_JOB_NODELIST")) != NULL ||
+            (env = getenv("SLURM_NODELIST")) != NULL ||
+            (env = getenv("SLURM_STEP_NODELIST")) != NULL) {
+            DEBUG("spunnel: nodes of job %u from the environment",jobid);
+            return strdup(env);
+        }
+    }
+
+    if (user != NULL &&
+        snprintf(path,sizeof(path),NODES_CACHE_PATTERN,user,jobid) < sizeof(path)) {
+        if ((nodes = _read_nodes_cache(path)) != NULL) {
+            DEBUG("spunnel: nodes of job %u from %s",jobid,path);
+            return nodes;
+        }
+    }
+    else
+        path[0] = '\0';
+
+    if (slurm_allocation_lookup(jobid,&alloc) != 0 || alloc == NULL) {
+        ERROR("spunnel: unable to look up allocation of job %u",jobid);
+        return NULL;
+    }
+    if (alloc->node_list != NULL) {
+        nodes = strdup(alloc->node_list);
+        if (nodes != NULL && path[0] != '\0')
+            _write_file(path,nodes);
+    }
+    slurm_free_resource_allocation_response_msg(alloc);
+    return nodes;
+}
+
+/*
+ * async=yes: forks the supervisor, which connects the nodes, reports how
+ * that went and then waits for slurm_spank_exit to close supervisor_fd.
+ * srun does not wait for any of it.  A failure is told to the user on
+ * srun's stderr as well as in the status file.
+ */
+static int _spunnel_connect_async (spank_t sp)
+{
+    char *user = getenv("USER");
+    char c;
+    int i, fds[2];
+    pid_t pid;
+
+    if (snprintf(status_file,sizeof(status_file),STATUS_FILE_PATTERN,
+                 user,session.jobid,session.stepid) >= sizeof(status_file) ||
+        pipe2(fds,O_CLOEXEC) != 0) {
+        ERROR("spunnel: unable to set up async tunnels, connecting now");
+        return _spunnel_connect_nodes();
+    }
+    _write_file(status_file,"pending\n");
+    if (spank_setenv(sp,STATUS_ENVVAR,status_file,1) != ESPANK_SUCCESS)
+        ERROR("spunnel: unable to set %s",STATUS_ENVVAR);
+
+    pid = fork();
+    if (pid < 0) {
+        ERROR("spunnel: unable to fork tunnel supervisor: %s",strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return _spunnel_connect_nodes();
+    }
+    if (pid == 0) {
+        close(fds[1]);
+        signal(SIGINT,SIG_IGN);
+        signal(SIGHUP,SIG_IGN);
+        signal(SIGPIPE,SIG_IGN);
+        // srun's death closes the pipe; what is started here follows us
+        if (owner_fd >= 0)
+            close(owner_fd);
+        owner_pid = getpid();
+        owner_fd = spunnel_pidfd(owner_pid);
+        if (_spunnel_connect_nodes() == 0) {
+            if (probe_timeout > 0 && transport == TRANSPORT_SSH && _probe_session(1) != 0)
+                _write_file(status_file,"timeout\n");
+            else
+                _write_file(status_file,"ready\n");
+        }
+        else {
+            _write_file(status_file,"failed\n");
+            fprintf(stderr,"spunnel: some tunnels could not be set up, see %s\n",status_file);
+        }
+        while (read(fds[0],&c,1) < 0 && errno == EINTR)
+            ;
+        _spunnel_teardown();
+        // srun may not be around to do it
+        unlink(status_file);
+        _exit(0);
+    }
+
+    // the supervisor has the reserved ports now
+    close(fds[0]);
+    for (i = 0; i < session.nports; i++) {
+        if (session.ports[i].fd >= 0)
+            close(session.ports[i].fd);
+        session.ports[i].fd = -1;
+    }
+    supervisor_pid = pid;
+    supervisor_fd = fds[1];
+    return 0;
+}
+
+/*
+ * This calls the functions that actually generate the ssh tunnel (_spunnel_connect_nodes, _connect_node)
+ *
+ */
+int slurm_spank_local_user_init (spank_t sp, int ac, char **av)
+{
+    int status = 0;
+    uint32_t jobid;
+    char *nodes;
+
+    // nothing to do in remote mode
+    if (spank_remote (sp))
+        return 0;
+
+    // If there are no ports and no ssh -L args, then there is nothing to do
+    if (nfwds == 0 && (args == NULL || strstr(args,"-L") == NULL)){
+        goto exit;
+    }
+
+    // get job id
+    if ( spank_get_item (sp, S_JOB_ID, &jobid)
+         != ESPANK_SUCCESS ) {
+        status = -1;
+        goto exit;
+    }
+    session.jobid = jobid;
+    registry_set_job(jobid);
+    if ( spank_get_item (sp, S_JOB_STEPID, &session.stepid)
+         != ESPANK_SUCCESS )
+        session.stepid = 0;
+
+    // get allocated nodes
+    if ( (nodes = _spunnel_job_nodes(jobid)) == NULL ) {
+        ERROR("spunnel: job has no allocated nodes defined");
+        status = -5;
+        goto exit;
+    }
+
+    // work out the ports, then connect required nodes
+    status = _session_init(nodes);
+    if (status == 0 && spank_setenv(sp,NODES_ENVVAR,nodes,1) != ESPANK_SUCCESS)
+        ERROR("spunnel: unable to set %s",NODES_ENVVAR);
+    free(nodes);
+    if (status != 0)
+        goto exit;
+    _session_export(sp);
+    owner_pid = getpid();
+    if ((owner_fd = spunnel_pidfd(owner_pid)) < 0)
+        DEBUG("spunnel: no pidfd (%s), tunnels stop with srun's thread instead",
+              strerror(errno));
+    if (async)
+        status = _spunnel_connect_async(sp);
+    else
+        status = _spunnel_connect_nodes();
+
+    exit:
+    return status;
+}
+
+/*
+ * Tears down what slurm_spank_local_user_init set up.  That only ever
+ * happens in srun, which keeps the session in memory between the two calls,
+ * so every other context has nothing to do here.  With async=yes it is the
+ * supervisor that has the session.  Calling it again does nothing.
+ *
+ * The ssh masters may be serving other sessions, so only this session's
+ * forwards are cancelled, over the control socket (see _master_forwards),
+ * which takes a local round trip per port and no ssh process.  A master
+ * exits by itself pool= seconds after its last session has let go of it.
+ */
+static void _spunnel_teardown (void)
+{
+    struct spunnel_node *node;
+    int i;
+
+    if (session.prober_pid > 0) {
+        kill(session.prober_pid,SIGTERM);
+        waitpid(session.prober_pid,NULL,0);
+        session.prober_pid = -1;
+    }
+
+    // letting go of spunneld ends its forwards
+    if (daemon_fd >= 0) {
+        close(daemon_fd);
+        daemon_fd = -1;
+    }
+
+    // stop the native relay, if this srun started one
+    _relay_thread_stop();
+    if (session.relay_pid > 0) {
+        kill(session.relay_pid,SIGTERM);
+        waitpid(session.relay_pid,NULL,0);
+        session.relay_pid = -1;
+    }
+
+    // remove this session's ssh tunnels
+    for (i = 0; i < session.nnodes; i++) {
+        node = &session.nodes[i];
+        if (!node->connected || session.watched)
+            continue;
+        if (node->hold < 0 && (node->hold = _master_connect(node)) < 0) {
+            node->hold = -1;
+            ERROR("tunnel: the ssh master of %s is gone",node->host);
+            continue;
+        }
+        _master_forwards(i,0);
+    }
+
+    _session_free();
+}
+
+/*
+ * What slurm_spank_user_init set up on an exec host for the exec ports it
+ * picked: the relay to them, the job's directory and the names of the
+ * sockets the relay listens on in it
+ */
+static pid_t exec_relay_pid = -1;
+static char exec_dir[108];
+static char **exec_paths = NULL;
+static int nexec_paths = 0;
+
+/*
+ * Makes the job's directory for the exec sockets, or checks the one an
+ * earlier step made.  Other jobs share the node, so it has to be ours and
+ * closed to everybody else.  Returns 0 if it is.
+ */
+static int _exec_dir (const char *dir)
+{
+    struct stat st;
+
+    if (mkdir(dir,0700) != 0 && errno != EEXIST) {
+        ERROR("spunnel: unable to make %s: %s",dir,strerror(errno));
+        return -1;
+    }
+    if (lstat(dir,&st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+        (st.st_mode & 077) != 0) {
+        ERROR("spunnel: %s is not a private directory of ours",dir);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * The exec port relay, forked from slurmstepd and running as the user.
+ * Picks the ports, claims them in the node's registry, writes them to out
+ * (one int per pair of fwds, -1 for the pairs that do not come here) and
+ * relays to them until slurmstepd goes.  The registry is left to it so
+ * that slurmstepd never maps a file the node's users can write.
+ */
+static void _exec_relay (int out, uint32_t jobid, uint32_t stepid,
+                         uint32_t nodeid, const char *user)
+{
+    struct relay *r;
+    struct port_table table;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char path[108];
+    int i, port, fd, npicked = 0, *ports;
+    ssize_t len, n;
+
+    if ((ports = malloc(nfwds * sizeof(int))) == NULL ||
+        port_table_scan(&table) != 0 || (r = relay_create()) == NULL) {
+        ERROR("spunnel: unable to pick exec ports");
+        _exit(1);
+    }
+    relay_set_backend(r,backend);
+    if (registry_path != NULL && registry_open(registry_path) != 0)
+        registry_path = NULL;
+    registry_set_job(jobid);
+    snprintf(path,sizeof(path),EXEC_DIR_PATTERN,user,jobid);
+    if (_exec_dir(path) != 0)
+        _exit(1);
+
+    for (i = 0; i < nfwds; i++) {
+        ports[i] = -1;
+        if (fwds[i].exec != 0 || _fwd_offset(&fwds[i],nodeid) < 0)
+            continue;
+        while ((port = port_table_pick(&table,auto_lo,auto_hi)) >= 0 &&
+               registry_claim(port,NULL) != 0)
+            ;
+        if (port < 0) {
+            ERROR("spunnel: no free exec port between %d and %d",auto_lo,auto_hi);
+            goto fail;
+        }
+        snprintf(path,sizeof(path),EXEC_SOCKET_PATTERN,user,jobid,stepid,i);
+        if (relay_resolve("127.0.0.1",port,&addr,&addrlen) != 0 ||
+            (fd = relay_listen_unix(path)) < 0) {
+            ERROR("spunnel: unable to listen on %s: %s",path,strerror(errno));
+            goto fail;
+        }
+        if (relay_add(r,fd,(struct sockaddr *)&addr,addrlen) != 0) {
+            close(fd);
+            unlink(path);
+            goto fail;
+        }
+        ports[i] = port;
+        npicked++;
+    }
+
+    for (len = 0; len < nfwds * sizeof(int); len += n) {
+        n = write(out,(char *)ports + len,nfwds * sizeof(int) - len);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n < 0)
+            goto fail;
+    }
+    close(out);
+    if (npicked == 0)
+        _exit(0);
+
+    _follow_owner(r);
+    _null_stdio(0);
+    if (relay_run(r) != 0)
+        _exit(1);
+    // slurmstepd is gone
+    for (i = 0; i < nfwds; i++) {
+        snprintf(path,sizeof(path),EXEC_SOCKET_PATTERN,user,jobid,stepid,i);
+        if (ports[i] >= 0)
+            unlink(path);
+    }
+    // other steps of the job may still have theirs in there
+    snprintf(path,sizeof(path),EXEC_DIR_PATTERN,user,jobid);
+    rmdir(path);
+    registry_close();
+    _exit(0);
+
+    fail:
+    while (--i >= 0) {
+        snprintf(path,sizeof(path),EXEC_SOCKET_PATTERN,user,jobid,stepid,i);
+        if (ports[i] >= 0)
+            unlink(path);
+    }
+    _exit(1);
+}
+
+/*
+ * The number srun gave this node, which is what the @ part of a port pair
+ * counts.  S_JOB_NODEID counts the step's nodes, and a step can run on
+ * fewer nodes than the allocation srun numbered them in, so this node is
+ * looked up in NODES_ENVVAR by its name in the step's node list.  Returns
+ * nodeid if the lists are not there.
+ */
+static uint32_t _exec_node_index (spank_t sp, uint32_t nodeid)
+{
+    hostlist_t hl;
+    char *step, *alloc, *host = NULL;
+    uint32_t i;
+    int idx = -1;
+
+    step = malloc(65536);
+    alloc = malloc(65536);
+    if (step == NULL || alloc == NULL ||
+        spank_getenv(sp,"SLURM_STEP_NODELIST",step,65536) != ESPANK_SUCCESS ||
+        spank_getenv(sp,NODES_ENVVAR,alloc,65536) != ESPANK_SUCCESS) {
+        DEBUG("spunnel: no node lists, taking node %u of the step for that of the job",nodeid);
+        goto done;
+    }
+    hl = slurm_hostlist_create(step);
+    for (i = 0; hl != NULL && i <= nodeid; i++) {
+        free(host);
+        host = slurm_hostlist_shift(hl);
+    }
+    if (hl != NULL)
+        slurm_hostlist_destroy(hl);
+    if (host != NULL && (hl = slurm_hostlist_create(alloc)) != NULL) {
+        idx = slurm_hostlist_find(hl,host);
+        slurm_hostlist_destroy(hl);
+    }
+    if (idx < 0)
+        ERROR("spunnel: node %u of the step is not in %s",nodeid,NODES_ENVVAR);
+
+    done:
+    free(host);
+    free(step);
+    free(alloc);
+    return (idx >= 0) ? (uint32_t)idx : nodeid;
+}
+
+/*
+ * Picks a free port on this node for every pair with an auto exec port
+ * that comes here and tells the job which in PORT_ENVVAR_PATTERN.  The
+ * login node forwards such a pair to a unix socket named after the job
+ * (EXEC_SOCKET_PATTERN), which it can do without waiting to hear the port,
+ * and a child relays the socket to the port.  The ports are claimed in the
+ * node's registry until the step ends, so jobs sharing the node each get
+ * their own; the child does the picking and claiming (see _exec_relay).
+ */
+static int _exec_ports_init (spank_t sp)
+{
+    char user[64], path[108], name[32], value[16];
+    uint32_t jobid, stepid, nodeid;
+    int i, fds[2], *ports, status = -1;
+    ssize_t len, n;
+    pid_t pid;
+
+    for (i = 0; i < nfwds && fwds[i].exec != 0; i++)
+        ;
+    if (i == nfwds)
+        return 0;
+    if (spank_get_item(sp,S_JOB_ID,&jobid) != ESPANK_SUCCESS ||
+        spank_get_item(sp,S_JOB_STEPID,&stepid) != ESPANK_SUCCESS ||
+        spank_get_item(sp,S_JOB_NODEID,&nodeid) != ESPANK_SUCCESS ||
+        spank_getenv(sp,"USER",user,sizeof(user)) != ESPANK_SUCCESS) {
+        ERROR("spunnel: unable to get the job details to pick exec ports");
+        return -1;
+    }
+    nodeid = _exec_node_index(sp,nodeid);
+    snprintf(exec_dir,sizeof(exec_dir),EXEC_DIR_PATTERN,user,jobid);
+    if ((exec_paths = calloc(nfwds,sizeof(char *))) == NULL ||
+        (ports = malloc(nfwds * sizeof(int))) == NULL) {
+        ERROR("spunnel: unable to pick exec ports");
+        return -1;
+    }
+    if (pipe2(fds,O_CLOEXEC) != 0) {
+        ERROR("spunnel: unable to pick exec ports: %s",strerror(errno));
+        free(ports);
+        return -1;
+    }
+
+    // like srun's relays it goes with slurmstepd, see owner_fd
+    owner_pid = getpid();
+    owner_fd = spunnel_pidfd(owner_pid);
+    pid = fork();
+    if (pid < 0) {
+        ERROR("spunnel: unable to fork exec port relay: %s",strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        goto done;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        // privileges are only dropped for the moment in user_init
+        if (setresgid(getegid(),getegid(),getegid()) != 0 ||
+            setresuid(geteuid(),geteuid(),geteuid()) != 0)
+            _exit(1);
+        signal(SIGPIPE,SIG_IGN);
+        signal(SIGTERM,SIG_DFL);
+        _exec_relay(fds[1],jobid,stepid,nodeid,user);
+    }
+    exec_relay_pid = pid;
+    close(fds[1]);
+
+    for (len = 0; len < nfwds * sizeof(int); len += n) {
+        n = read(fds[0],(char *)ports + len,nfwds * sizeof(int) - len);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n <= 0)
+            break;
+    }
+    close(fds[0]);
+    if (len < nfwds * sizeof(int)) {
+        ERROR("spunnel: unable to pick exec ports");
+        goto done;
+    }
+    for (i = 0; i < nfwds; i++) {
+        if (ports[i] < 0)
+            continue;
+        snprintf(path,sizeof(path),EXEC_SOCKET_PATTERN,user,jobid,stepid,i);
+        exec_paths[nexec_paths++] = strdup(strrchr(path,'/') + 1);
+        snprintf(name,sizeof(name),PORT_ENVVAR_PATTERN,i);
+        snprintf(value,sizeof(value),"%d",ports[i]);
+        if (spank_setenv(sp,name,value,1) != ESPANK_SUCCESS)
+            ERROR("spunnel: unable to set %s",name);
+        INFO("spunnel: exec port of --tunnel pair %d is %d",i,ports[i]);
+    }
+    status = 0;
+
+    done:
+    free(ports);
+    if (owner_fd >= 0)
+        close(owner_fd);
+    owner_fd = -1;
+    return status;
+}
+
+int slurm_spank_user_init (spank_t sp, int ac, char **av)
+{
+    if (!spank_remote(sp))
+        return 0;
+    return _exec_ports_init(sp);
+}
+
+int slurm_spank_exit (spank_t sp, int ac, char **av){
+    int i, dir = -1;
+
+    if (spank_context() == S_CTX_REMOTE) {
+        if (exec_relay_pid > 0) {
+            kill(exec_relay_pid,SIGTERM);
+            waitpid(exec_relay_pid,NULL,0);
+            exec_relay_pid = -1;
+        }
+        // slurmstepd is root, and the directory is the user's: remove the
+        // sockets through it, so a link put in its place leads nowhere
+        if (nexec_paths > 0)
+            dir = open(exec_dir,O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        for (i = 0; i < nexec_paths; i++) {
+            if (dir >= 0)
+                unlinkat(dir,exec_paths[i],0);
+            free(exec_paths[i]);
+        }
+        if (dir >= 0) {
+            close(dir);
+            rmdir(exec_dir);
+        }
+        free(exec_paths);
+        exec_paths = NULL;
+        nexec_paths = 0;
+        return 0;
+    }
+    if (spank_context() != S_CTX_LOCAL)
+        return 0;
+
+    // an async session is the supervisor's to tear down
+    if (supervisor_pid > 0) {
+        close(supervisor_fd);
+        waitpid(supervisor_pid,NULL,0);
+        unlink(status_file);
+        supervisor_pid = -1;
+        supervisor_fd = -1;
+    }
+    _spunnel_teardown();
+    registry_close();
+    if (owner_fd >= 0)
+        close(owner_fd);
+    owner_fd = -1;
+    return 0;
+}
+
+
+/*
+ * Records one port pair of --tunnel, or a range of them like
+ * 8000-8031:9000-9031, taken apart in place.  Each becomes a
+ * -L <submit port>:localhost:<exec port> (or a native relay listener) on
+ * the nodes selected by its optional @ part.  Exits on a bad pair, like
+ * srun does for its own options.
+ */
+static void _tunnel_add_pairs (char *pair)
+{
+    struct spunnel_fwd *fwd;
+    char *nodes, *firststr, *secondstr, *ptr;
+    int first, firsthi, second, secondhi;
+    int count, nodecount, isauto, execauto, k;
+
+    nodes = strchr(pair,'@');
+    if (nodes != NULL){
+        *nodes++ = '\0';
+    }
+    firststr = strtok_r(pair,":",&ptr);
+    secondstr = strtok_r(NULL,":",&ptr);
+
+    if (firststr == NULL || secondstr == NULL){
+        fprintf(stderr,"--tunnel parameter needs two numeric ports separated by a colon\n");
+        exit(1);
+    }
+
+    // auto picks the submit port(s) later, see _fwd_submit_port, and
+    // the exec port(s) on the nodes, see _exec_ports_init
+    isauto = (strcmp(firststr,"auto") == 0);
+    execauto = (strcmp(secondstr,"auto") == 0);
+    first = firsthi = auto_lo;
+    second = secondhi = auto_lo;
+    if ((!isauto && _parse_node_range(firststr,&first,&firsthi) != 0) ||
+        (!execauto && _parse_node_range(secondstr,&second,&secondhi) != 0)){
+        fprintf(stderr,"--tunnel parameter requires two numeric ports separated by a colon\n");
+        exit(1);
+    }
+    if (!isauto && !execauto && firsthi - first != secondhi - second){
+        fprintf(stderr,"--tunnel port ranges must be the same length on both sides\n");
+        exit(1);
+    }
+    count = isauto ? secondhi - second + 1 : firsthi - first + 1;
+    if (execauto && transport != TRANSPORT_SSH){
+        fprintf(stderr,"--tunnel can only pick the exec port with transport=ssh\n");
+        exit(1);
+    }
+
+    nodecount = 1;
+    if (nodes != NULL && (nodecount = _check_nodes(nodes)) < 0){
+        fprintf(stderr,"--tunnel node selection must be @all or node indices like @0+2-3\n");
+        exit(1);
+    }
+    // the ports of further nodes would run into the rest of the range
+    if (count > 1 && nodecount != 1){
+        fprintf(stderr,"--tunnel port ranges can only go to a single node\n");
+        exit(1);
+    }
+    if (first < 1024 || second < 1024 || (!isauto && firsthi + nodecount - 1 > 65535) || secondhi > 65535){
+        fprintf(stderr,"--tunnel cannot be used for privileged ports (< 1024) or ports above 65535\n");
+        exit(1);
+    }
+
+    for (k = 0; k < count; k++){
+        if ((fwd = _fwd_new()) == NULL){
+            fprintf(stderr,"--tunnel: out of memory\n");
+            exit(1);
+        }
+        // srun keeps the port from here on (see _fwd_submit_port), and
+        // salloc/sbatch, on the submit host too, only check it.  On the
+        // exec hosts the submit port means nothing.
+        fwd->fd = -1;
+        if (!isauto && spank_context() == S_CTX_LOCAL &&
+            (fwd->fd = _reserve_port(first + k,0)) < 0){
+            exit(1);
+        }
+        if (!isauto && spank_context() == S_CTX_ALLOCATOR && !port_available(first + k)){
+            fprintf(stderr,"port %d is in use or unavailable\n",first + k);
+            exit(1);
+        }
+        fwd->submit = isauto ? 0 : first + k;
+        fwd->exec = execauto ? 0 : second + k;
+        fwd->nodes = (nodes != NULL) ? strdup(nodes) : NULL;
+    }
+}
+
+/*
+ * Records the port pairs given to the --tunnel option, in one pass over
+ * the list however long it is
+ */
+static int _tunnel_opt_process (int val, const char *optarg, int remote)
+{
+    char *portlist, *pair, *ptr;
+
+    if (optarg == NULL) {
+        fprintf(stderr,"--tunnel requires an argument, e.g. 8888:8888");
+        return (0);
+    }
+
+    portlist = strdup(optarg);
+    for (pair = strtok_r(portlist,",",&ptr); pair != NULL; pair = strtok_r(NULL,",",&ptr))
+        _tunnel_add_pairs(pair);
+    free(portlist);
+
+    return (0);
+}
+
+
+/*
+ * Process any options on the plugstack.conf line
+ */
+void _spunnel_init_config(spank_t sp, int ac, char *av[])
 {
     int i;
     char* elt;
@@ -521,8 +2417,81 @@ void _spunnel_init_config(spank_t sp, int ac, char *av[])
                 p++;
             }
         }
-        else if ( strncmp(elt,"args=",9) == 0 ) {
-            args=strdup(elt+9);
+        else if ( strncmp(elt,"transport=",10) == 0 ) {
+            if ( strcmp(elt+10,"native") == 0 )
+                transport = TRANSPORT_NATIVE;
+            else if ( strcmp(elt+10,"daemon") == 0 )
+                transport = TRANSPORT_DAEMON;
+            else if ( strcmp(elt+10,"ssh") == 0 )
+                transport = TRANSPORT_SSH;
+            else
+                ERROR("spunnel: unknown transport %s, using ssh",elt+10);
+        }
+        else if ( strncmp(elt,"forwarder=",10) == 0 ) {
+            if ( strcmp(elt+10,"thread") == 0 )
+                forwarder_thread = 1;
+            else if ( strcmp(elt+10,"process") == 0 )
+                forwarder_thread = 0;
+            else
+                ERROR("spunnel: unknown forwarder %s, using process",elt+10);
+        }
+        else if ( strncmp(elt,"workers=",8) == 0 ) {
+            relay_workers = atoi(elt+8);
+            if ( relay_workers < 1 || relay_workers > 256 ) {
+                ERROR("spunnel: workers must be between 1 and 256, using 1");
+                relay_workers = 1;
+            }
+        }
+        else if ( strncmp(elt,"pin=",4) == 0 ) {
+            relay_pin = (strcmp(elt+4,"yes") == 0);
+        }
+        else if ( strncmp(elt,"backend=",8) == 0 ) {
+            if ( strcmp(elt+8,"io_uring") == 0 )
+                backend = RELAY_BACKEND_URING;
+            else if ( strcmp(elt+8,"epoll") == 0 )
+                backend = RELAY_BACKEND_EPOLL;
+            else if ( strcmp(elt+8,"auto") == 0 )
+                backend = RELAY_BACKEND_AUTO;
+            else
+                ERROR("spunnel: unknown backend %s, using auto",elt+8);
+        }
+        else if ( strncmp(elt,"auto_ports=",11) == 0 ) {
+            if ( sscanf(elt+11,"%d-%d",&auto_lo,&auto_hi) != 2 ||
+                 auto_lo < 1024 || auto_hi > 65535 || auto_hi < auto_lo ) {
+                ERROR("spunnel: bad auto_ports %s, using %d-%d",elt+11,
+                      DEFAULT_AUTO_LO,DEFAULT_AUTO_HI);
+                auto_lo = DEFAULT_AUTO_LO;
+                auto_hi = DEFAULT_AUTO_HI;
+            }
+        }
+        else if ( strncmp(elt,"daemon=",7) == 0 ) {
+            daemon_path = strdup(elt+7);
+        }
+        else if ( strncmp(elt,"registry=",9) == 0 ) {
+            if ( strcmp(elt+9,"none") == 0 )
+                registry_path = NULL;
+            else
+                registry_path = strdup(elt+9);
+        }
+        else if ( strncmp(elt,"probe=",6) == 0 ) {
+            probe_timeout = atoi(elt+6);
+        }
+        else if ( strncmp(elt,"lazy=",5) == 0 ) {
+            lazy_idle = atoi(elt+5);
+        }
+        else if ( strncmp(elt,"idle=",5) == 0 ) {
+            idle_timeout = atoi(elt+5);
+        }
+        else if ( strncmp(elt,"async=",6) == 0 ) {
+            async = (strcmp(elt+6,"yes") == 0);
+        }
+        else if ( strncmp(elt,"pool=",5) == 0 ) {
+            pool_idle = atoi(elt+5);
+            if ( pool_idle <= 0 )
+                pool_idle = DEFAULT_POOL_IDLE;
+        }
+        else if ( strncmp(elt,"args=",5) == 0 ) {
+            args=strdup(elt+5);
             p = args;
             while ( p != NULL && *p != '\0' ) {
                 if ( *p == '|' )
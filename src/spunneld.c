@@ -0,0 +1,661 @@
+/***************************************************************************\
+ spunneld.c - login node daemon relaying the tunnels of every srun
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+
+/*
+ * The plugin's transport=daemon hands its reserved submit port listeners
+ * to this daemon instead of relaying them itself, so a login node serves
+ * every user's tunnels from one process: a session costs a few hundred
+ * bytes here rather than an ssh master or a relay process of its own.
+ *
+ * Sessions (the connections sruns register on, see spunneld.h) are read
+ * by the main thread.  The peer's uid comes from SO_PEERCRED and the job
+ * it names must be a running job of that uid with the target host among
+ * its nodes.  Jobs are looked up by a thread of their own, so that a slow
+ * slurmctld only holds up the sessions waiting for it, and what it found
+ * is kept for a while.  Each session's listeners are given to one of a few worker
+ * threads, each running a relay (relay.h) of its own, which pick up
+ * changes whenever the main thread wakes them through their stop fd.
+ *
+ * It needs no privileges and is best run as a user of its own.
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include <slurm/slurm.h>
+
+#include "relay.h"
+#include "spunneld.h"
+
+#define DEFAULT_THREADS 2
+#define MAX_EVENTS      64
+#define VERDICT_TTL     60      // seconds a job lookup is good for
+#define SESSION_WAIT    -2      // see _session_request
+#define SESSION_NONE    -3
+
+/*
+ * A change for a worker's relay, queued by the main thread
+ */
+struct op {
+    int                     add;    // relay_add, or relay_remove
+    int                     fd;
+    struct sockaddr_storage addr;
+    socklen_t               addrlen;
+    struct op              *next;
+};
+
+struct worker {
+    pthread_t       thread;
+    struct relay   *r;
+    int             wake;       // eventfd, the relay's stop fd
+    pthread_mutex_t lock;
+    struct op      *ops;        // oldest first
+    struct op     **ops_tail;
+    int             nsessions;
+};
+
+/*
+ * What looking up jobid for uid said: 0 and the job's nodes if uid may
+ * relay to them, or the errno to refuse with.  rc is -1 until the lookup
+ * thread is done, which it says through lookup_done.
+ */
+struct verdict {
+    uid_t           uid;
+    uint32_t        jobid;
+    int             rc;
+    char           *nodes;
+    time_t          expires;
+    int             waiters;    // sessions parked on it
+    struct verdict *next;
+    struct verdict *next_lookup;
+};
+
+struct session {
+    int         fd;
+    uid_t       uid;
+    uint32_t    jobid;          // 0 until the first request
+    hostlist_t  nodes;
+    int         worker;
+    int        *lfds;           // the listeners given to the worker
+    int         nlfds;
+    int         lfds_size;
+
+    // a request parked until its job has been looked up
+    struct verdict     *waiting;
+    struct spunneld_req req;
+    int                 req_fd;
+    struct session     *next_waiting;
+};
+
+static struct worker *workers = NULL;
+static int nworkers = DEFAULT_THREADS;
+
+/*
+ * The verdicts are the main thread's, but for the rc, nodes and expires of
+ * those being looked up, which lookup_lock covers
+ */
+static struct verdict *verdicts = NULL;
+static struct session *waiting = NULL;
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lookup_cond = PTHREAD_COND_INITIALIZER;
+static struct verdict *lookups = NULL;          // queued, oldest first
+static struct verdict **lookups_tail = &lookups;
+static int lookup_done = -1;                    // eventfd
+
+/*
+ * Applies what the main thread queued, in order.  A listener the relay
+ * could not take stays open until its removal, so that its fd number is
+ * not reused in the meantime.
+ */
+static void _worker_ops (struct worker *w)
+{
+    struct op *op, *next;
+    uint64_t n;
+
+    if (read(w->wake,&n,sizeof(n)) < 0 && errno != EAGAIN)
+        fprintf(stderr,"spunneld: worker wakeup: %s\n",strerror(errno));
+    pthread_mutex_lock(&w->lock);
+    op = w->ops;
+    w->ops = NULL;
+    w->ops_tail = &w->ops;
+    pthread_mutex_unlock(&w->lock);
+
+    for (; op != NULL; op = next) {
+        next = op->next;
+        if (op->add) {
+            if (relay_add(w->r,op->fd,(struct sockaddr *)&op->addr,op->addrlen) != 0)
+                fprintf(stderr,"spunneld: unable to relay fd %d\n",op->fd);
+        }
+        else if (relay_remove(w->r,op->fd) != 0)
+            close(op->fd);
+        free(op);
+    }
+}
+
+static void *_worker_main (void *arg)
+{
+    struct worker *w = arg;
+
+    for (;;) {
+        if (relay_run(w->r) != 0) {
+            fprintf(stderr,"spunneld: relay failed, exiting\n");
+            exit(1);
+        }
+        _worker_ops(w);
+    }
+    return NULL;
+}
+
+static int _worker_queue (struct worker *w, int add, int fd,
+                          const struct sockaddr_storage *addr, socklen_t addrlen)
+{
+    uint64_t one = 1;
+    struct op *op;
+
+    if ((op = calloc(1,sizeof(*op))) == NULL)
+        return -1;
+    op->add = add;
+    op->fd = fd;
+    if (addr != NULL)
+        memcpy(&op->addr,addr,addrlen);
+    op->addrlen = addrlen;
+    pthread_mutex_lock(&w->lock);
+    *w->ops_tail = op;
+    w->ops_tail = &op->next;
+    pthread_mutex_unlock(&w->lock);
+    if (write(w->wake,&one,sizeof(one)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+static int _workers_start (void)
+{
+    struct worker *w;
+    int i;
+
+    if ((workers = calloc(nworkers,sizeof(*workers))) == NULL)
+        return -1;
+    for (i = 0; i < nworkers; i++) {
+        w = &workers[i];
+        w->ops_tail = &w->ops;
+        pthread_mutex_init(&w->lock,NULL);
+        // relay_run picks up changes between runs, which io_uring can't do
+        if ((w->r = relay_create()) == NULL ||
+            (w->wake = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+            relay_set_stop(w->r,w->wake) != 0)
+            return -1;
+        relay_set_backend(w->r,RELAY_BACKEND_EPOLL);
+        if (pthread_create(&w->thread,NULL,_worker_main,w) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Asks slurmctld whether uid may relay to the nodes of jobid, which it may
+ * if that is a running job of its own
+ */
+static int _lookup (uid_t uid, uint32_t jobid, char **nodes)
+{
+    job_info_msg_t *msg;
+    job_info_t *job;
+    int rc = 0;
+
+    *nodes = NULL;
+    if (slurm_load_job(&msg,jobid,SHOW_ALL) != 0) {
+        fprintf(stderr,"spunneld: unable to load job %u: %s\n",jobid,
+                slurm_strerror(slurm_get_errno()));
+        return ESRCH;
+    }
+    job = (msg->record_count > 0) ? &msg->job_array[0] : NULL;
+    if (job == NULL || job->user_id != uid ||
+        (job->job_state & JOB_STATE_BASE) != JOB_RUNNING || job->nodes == NULL)
+        rc = EPERM;
+    else if ((*nodes = strdup(job->nodes)) == NULL)
+        rc = ENOMEM;
+    slurm_free_job_info_msg(msg);
+    return rc;
+}
+
+static void *_lookup_main (void *arg)
+{
+    struct verdict *v;
+    uint64_t one = 1;
+    char *nodes;
+    int rc;
+
+    for (;;) {
+        pthread_mutex_lock(&lookup_lock);
+        while (lookups == NULL)
+            pthread_cond_wait(&lookup_cond,&lookup_lock);
+        v = lookups;
+        if ((lookups = v->next_lookup) == NULL)
+            lookups_tail = &lookups;
+        pthread_mutex_unlock(&lookup_lock);
+
+        rc = _lookup(v->uid,v->jobid,&nodes);
+        pthread_mutex_lock(&lookup_lock);
+        v->nodes = nodes;
+        v->expires = time(NULL) + VERDICT_TTL;
+        v->rc = rc;
+        pthread_mutex_unlock(&lookup_lock);
+        if (write(lookup_done,&one,sizeof(one)) < 0 && errno != EAGAIN)
+            fprintf(stderr,"spunneld: lookup wakeup: %s\n",strerror(errno));
+    }
+    return NULL;
+}
+
+static int _verdict_rc (struct verdict *v)
+{
+    int rc;
+
+    pthread_mutex_lock(&lookup_lock);
+    rc = v->rc;
+    pthread_mutex_unlock(&lookup_lock);
+    return rc;
+}
+
+/*
+ * The verdict on jobid for uid, queueing a lookup if there is none yet or
+ * it expired.  A uid gets one lookup at a time, so that whoever makes up
+ * job ids only waits for their own: another job is refused with EBUSY
+ * (and srun relays the ports itself) while one is being looked up.
+ */
+static struct verdict *_verdict (uid_t uid, uint32_t jobid, int *rc)
+{
+    struct verdict *v, **p;
+    time_t now = time(NULL);
+    int done;
+
+    for (p = &verdicts; (v = *p) != NULL; ) {
+        done = (_verdict_rc(v) >= 0);
+        if (done && v->expires <= now && v->waiters == 0) {
+            *p = v->next;
+            free(v->nodes);
+            free(v);
+            continue;
+        }
+        if (v->uid == uid && v->jobid == jobid && (!done || v->expires > now))
+            return v;
+        p = &v->next;
+    }
+    for (v = verdicts; v != NULL; v = v->next) {
+        if (v->uid == uid && _verdict_rc(v) < 0) {
+            *rc = EBUSY;
+            return NULL;
+        }
+    }
+    if ((v = calloc(1,sizeof(*v))) == NULL) {
+        *rc = ENOMEM;
+        return NULL;
+    }
+    v->uid = uid;
+    v->jobid = jobid;
+    v->rc = -1;
+    v->next = verdicts;
+    verdicts = v;
+    pthread_mutex_lock(&lookup_lock);
+    *lookups_tail = v;
+    lookups_tail = &v->next_lookup;
+    pthread_cond_signal(&lookup_cond);
+    pthread_mutex_unlock(&lookup_lock);
+    return v;
+}
+
+/*
+ * Relays the listener lfd that came with req, or refuses it.  The first
+ * request of a session settles its job, from v if it waited for it.
+ * Returns the errno to answer with, or SESSION_WAIT if the request has
+ * been parked on a lookup.
+ */
+static int _session_forward (struct session *s, struct spunneld_req *req,
+                             int lfd, struct verdict *v)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int *tmp;
+    int rc;
+
+    if (s->jobid == 0) {
+        if (v == NULL && (v = _verdict(s->uid,req->jobid,&rc)) == NULL)
+            goto refuse;
+        if (_verdict_rc(v) < 0) {
+            v->waiters++;
+            s->waiting = v;
+            s->req = *req;
+            s->req_fd = lfd;
+            s->next_waiting = waiting;
+            waiting = s;
+            return SESSION_WAIT;
+        }
+        if ((rc = v->rc) != 0)
+            goto refuse;
+        if ((s->nodes = slurm_hostlist_create(v->nodes)) == NULL) {
+            rc = ENOMEM;
+            goto refuse;
+        }
+        s->jobid = req->jobid;
+    }
+    if (req->jobid != s->jobid || slurm_hostlist_find(s->nodes,req->host) < 0) {
+        rc = EPERM;
+        goto refuse;
+    }
+    if (relay_resolve(req->host,req->port,&addr,&addrlen) != 0) {
+        rc = EHOSTUNREACH;
+        goto refuse;
+    }
+    if (s->nlfds == s->lfds_size) {
+        s->lfds_size = s->lfds_size ? 2 * s->lfds_size : 4;
+        if ((tmp = realloc(s->lfds,s->lfds_size * sizeof(int))) == NULL) {
+            rc = ENOMEM;
+            goto refuse;
+        }
+        s->lfds = tmp;
+    }
+    fcntl(lfd,F_SETFL,fcntl(lfd,F_GETFL) | O_NONBLOCK);
+    if (_worker_queue(&workers[s->worker],1,lfd,&addr,addrlen) != 0) {
+        rc = ENOMEM;
+        goto refuse;
+    }
+    s->lfds[s->nlfds++] = lfd;
+    return 0;
+
+    refuse:
+    close(lfd);
+    fprintf(stderr,"spunneld: refused a forwarding to %s:%d for uid %u: %s\n",
+            req->host,req->port,(unsigned)s->uid,strerror(rc));
+    return rc;
+}
+
+/*
+ * Handles one request of session s.  Returns the errno to answer with,
+ * SESSION_WAIT if the answer has to wait for a job lookup, SESSION_NONE if
+ * there was nothing to read after all, or -1 if the session is over.
+ */
+static int _session_request (struct session *s)
+{
+    struct spunneld_req req;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr hdr;
+        char           buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    int lfd = -1, listening = 0, rc;
+    socklen_t optlen = sizeof(listening);
+    ssize_t n;
+
+    memset(&req,0,sizeof(req));
+    memset(&msg,0,sizeof(msg));
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    while ((n = recvmsg(s->fd,&msg,MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return SESSION_NONE;
+    if (n <= 0)
+        return -1;
+    req.host[sizeof(req.host) - 1] = '\0';
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg,cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+            memcpy(&lfd,CMSG_DATA(cmsg),sizeof(int));
+    }
+
+    if (n != sizeof(req) || req.version != SPUNNELD_VERSION || lfd < 0 ||
+        (msg.msg_flags & MSG_CTRUNC)) {
+        rc = EINVAL;
+        goto refuse;
+    }
+    if (getsockopt(lfd,SOL_SOCKET,SO_ACCEPTCONN,&listening,&optlen) != 0 || !listening) {
+        rc = ENOTSOCK;
+        goto refuse;
+    }
+    return _session_forward(s,&req,lfd,NULL);
+
+    refuse:
+    if (lfd >= 0)
+        close(lfd);
+    fprintf(stderr,"spunneld: refused a forwarding to %s:%d for uid %u: %s\n",
+            req.host[0] ? req.host : "?",req.port,(unsigned)s->uid,strerror(rc));
+    return rc;
+}
+
+static void _session_end (int epfd, struct session *s)
+{
+    int i;
+
+    for (i = 0; i < s->nlfds; i++)
+        _worker_queue(&workers[s->worker],0,s->lfds[i],NULL,0);
+    workers[s->worker].nsessions--;
+    epoll_ctl(epfd,EPOLL_CTL_DEL,s->fd,NULL);
+    close(s->fd);
+    if (s->nodes != NULL)
+        slurm_hostlist_destroy(s->nodes);
+    free(s->lfds);
+    free(s);
+}
+
+/*
+ * Answers a request of s, ending the session if that fails
+ */
+static void _session_reply (int epfd, struct session *s, int32_t reply)
+{
+    if (send(s->fd,&reply,sizeof(reply),MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(reply))
+        _session_end(epfd,s);
+}
+
+/*
+ * Goes on with the sessions whose lookups are done
+ */
+static void _sessions_resume (int epfd)
+{
+    struct epoll_event ev;
+    struct session *s, **p;
+    struct verdict *v;
+    uint64_t n;
+    int32_t reply;
+
+    if (read(lookup_done,&n,sizeof(n)) < 0 && errno != EAGAIN)
+        fprintf(stderr,"spunneld: lookup wakeup: %s\n",strerror(errno));
+    for (p = &waiting; (s = *p) != NULL; ) {
+        if (_verdict_rc(s->waiting) < 0) {
+            p = &s->next_waiting;
+            continue;
+        }
+        *p = s->next_waiting;
+        v = s->waiting;
+        v->waiters--;
+        s->waiting = NULL;
+        reply = _session_forward(s,&s->req,s->req_fd,v);
+        s->req_fd = -1;
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        if (epoll_ctl(epfd,EPOLL_CTL_ADD,s->fd,&ev) != 0)
+            _session_end(epfd,s);
+        else
+            _session_reply(epfd,s,reply);
+    }
+}
+
+static void _session_new (int epfd, int lfd)
+{
+    struct epoll_event ev;
+    struct session *s;
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int fd, i;
+
+    // nonblocking, so that a peer that does not read its answers is dropped
+    // rather than holding up everybody else
+    if ((fd = accept4(lfd,NULL,NULL,SOCK_CLOEXEC | SOCK_NONBLOCK)) < 0)
+        return;
+    if (getsockopt(fd,SOL_SOCKET,SO_PEERCRED,&cred,&len) != 0 ||
+        (s = calloc(1,sizeof(*s))) == NULL) {
+        close(fd);
+        return;
+    }
+    s->fd = fd;
+    s->uid = cred.uid;
+    s->req_fd = -1;
+    // the least busy worker gets all of the session
+    for (i = 1; i < nworkers; i++) {
+        if (workers[i].nsessions < workers[s->worker].nsessions)
+            s->worker = i;
+    }
+    workers[s->worker].nsessions++;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = s;
+    if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) != 0)
+        _session_end(epfd,s);
+}
+
+static int _listen (const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path,path);
+    if ((fd = socket(AF_UNIX,SOCK_STREAM | SOCK_CLOEXEC,0)) < 0)
+        return -1;
+    unlink(path);
+    // anyone may register, SO_PEERCRED says who they are
+    if (bind(fd,(struct sockaddr *)&addr,sizeof(addr)) != 0 ||
+        chmod(path,0666) != 0 || listen(fd,128) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void _usage (void)
+{
+    fprintf(stderr,"usage: spunneld [-s socket] [-t threads]\n"
+            "  -s socket   where sruns register (default " SPUNNELD_SOCKET ")\n"
+            "  -t threads  relay threads (default %d)\n",DEFAULT_THREADS);
+}
+
+int main (int argc, char **argv)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct session *s;
+    const char *path = SPUNNELD_SOCKET;
+    pthread_t lookup_thread;
+    int32_t reply;
+    int lfd, epfd, c, i, n;
+
+    while ((c = getopt(argc,argv,"s:t:h")) != -1) {
+        switch (c) {
+        case 's':
+            path = optarg;
+            break;
+        case 't':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) {
+                _usage();
+                return 2;
+            }
+            break;
+        default:
+            _usage();
+            return (c == 'h') ? 0 : 2;
+        }
+    }
+
+    signal(SIGPIPE,SIG_IGN);
+    if ((lfd = _listen(path)) < 0) {
+        fprintf(stderr,"spunneld: unable to listen on %s: %s\n",path,strerror(errno));
+        return 1;
+    }
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 || _workers_start() != 0 ||
+        (lookup_done = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+        pthread_create(&lookup_thread,NULL,_lookup_main,NULL) != 0) {
+        fprintf(stderr,"spunneld: unable to start: %s\n",strerror(errno));
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd,EPOLL_CTL_ADD,lfd,&ev);
+    ev.data.ptr = &lookup_done;
+    epoll_ctl(epfd,EPOLL_CTL_ADD,lookup_done,&ev);
+
+    for (;;) {
+        n = epoll_wait(epfd,events,MAX_EVENTS,-1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr,"spunneld: epoll_wait: %s\n",strerror(errno));
+            return 1;
+        }
+        for (i = 0; i < n; i++) {
+            if ((s = events[i].data.ptr) == NULL) {
+                _session_new(epfd,lfd);
+                continue;
+            }
+            if (events[i].data.ptr == &lookup_done) {
+                _sessions_resume(epfd);
+                continue;
+            }
+            reply = _session_request(s);
+            if (reply == SESSION_NONE)
+                continue;
+            // it has no say until the request is answered
+            if (reply == SESSION_WAIT)
+                epoll_ctl(epfd,EPOLL_CTL_DEL,s->fd,NULL);
+            else if (reply < 0)
+                _session_end(epfd,s);
+            else
+                _session_reply(epfd,s,reply);
+        }
+    }
+    return 0;
+}
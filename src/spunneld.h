@@ -0,0 +1,50 @@
+/***************************************************************************\
+ spunneld.h - what the plugin and spunneld say to each other
+ ***************************************************************************
+ * Copyright  Harvard University (2014)
+ *
+ * This file is part of spunnel, a SLURM SPANK Plugin aiming at
+ * providing arbitrary port forwarding on SLURM execution
+ * nodes using OpenSSH.
+ *
+ * spunnel is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by the
+ * Free Software Foundation; either version 2 of the License, or (at your
+ * option) any later version.
+ *
+ * spunnel is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with spunnel; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+\***************************************************************************/
+#ifndef _SPUNNEL_SPUNNELD_H
+#define _SPUNNEL_SPUNNELD_H
+
+#include <stdint.h>
+
+/*
+ * Where spunneld listens by default, see daemon= in plugstack.conf
+ */
+#define SPUNNELD_SOCKET  "/run/spunneld/spunneld.sock"
+#define SPUNNELD_VERSION 1
+
+/*
+ * One forwarding, sent by srun with the listener it reserved for the
+ * submit port attached (SCM_RIGHTS).  spunneld answers each with an
+ * int32_t, 0 or the errno saying why it refused.  The forwardings last as
+ * long as the connection they were sent on, so srun ending them is simply
+ * closing it, and so is srun dying.
+ */
+struct spunneld_req {
+    uint32_t version;
+    uint32_t jobid;
+    int32_t  port;          // on the exec host
+    char     host[256];
+};
+
+#endif